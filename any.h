@@ -25,7 +25,11 @@
 #define ANY_H
 
 #include <algorithm>
+#include <cstddef>
+#include <new>
 #include <typeinfo>
+#include <type_traits>
+#include <utility>
 #include <iostream>
 
 
@@ -33,24 +37,39 @@
 namespace any {
 #endif
 
+  // Values of up to bufferSize bytes that can be moved without throwing,
+  // such as scalars and short strings, are stored within the Any object,
+  // larger ones on the heap. The type of the value is identified by the
+  // address of the table of its operations.
   class Any {
   public: // structors
 
-    Any() : content(0)
+    Any() : table(0)
     {}
     template<typename ValueType>
-    Any(const ValueType & value) : content(new holder<ValueType>(value))
-    {}
-    Any(const Any & other) : content(other.content ? other.content->clone() : 0)
-    {}
+    Any(const ValueType & value) : table(&handler<ValueType>::operations) {
+      handler<ValueType>::create(data, value);
+    }
+    Any(const Any & other) : table(other.table) {
+      if (table)
+        table->clone(other.data, data);
+    }
+    Any(Any && other) noexcept : table(other.table) {
+      if (table)
+        table->move(other.data, data);
+      other.table = 0;
+    }
     ~Any() {
-      delete content;
+      if (table)
+        table->destroy(data);
     }
 
   public: // modifiers
 
-    Any & swap(Any & rhs) {
-      std::swap(content, rhs.content);
+    Any & swap(Any & rhs) noexcept {
+      Any tmp(std::move(rhs));
+      rhs = std::move(*this);
+      *this = std::move(tmp);
       return *this;
     }
     template<typename ValueType>
@@ -58,72 +77,127 @@ namespace any {
       Any(rhs).swap(*this);
       return *this;
     }
-#if 1
     Any & operator=(const Any & rhs) {
       Any(rhs).swap(*this);
       return *this;
     }
-#else
-    Any& operator=(const Any& value) {
-      content = (value.content ? value.content->clone() : 0);
+    Any & operator=(Any && rhs) noexcept {
+      if (this != &rhs) {
+        if (table)
+          table->destroy(data);
+        table = rhs.table;
+        if (table)
+          table->move(rhs.data, data);
+        rhs.table = 0;
+      }
       return *this;
     }
-#endif
 
   public: // queries
 
     bool empty() const {
-      return !content;
+      return !table;
     }
     const std::type_info & type() const {
-      return content ? content->type() : typeid(void);
+      return table ? table->type() : typeid(void);
     }
     friend std::ostream& operator << (std::ostream& os, const Any& value) {
-      value.content->printOn(os);
+      if (value.table)
+        value.table->print(value.data, os);
       return os;
     }
 
-  public: // types (public so any_cast can be non-friend)
+    // Pointer to the value if it is of type ValueType, 0 otherwise. The
+    // table addresses are compared first, typeid only if they differ, as
+    // they may for values created in another shared object.
+    template<typename ValueType>
+    ValueType * get() {
+      typedef typename std::remove_cv<ValueType>::type value_type;
+      if (table == &handler<value_type>::operations ||
+          (table && table->type() == typeid(value_type)))
+        return handler<value_type>::get(data);
+      return 0;
+    }
 
-    class placeholder {
-    public: // structors
+  public: // types (public so any_cast can be non-friend)
 
-      virtual ~placeholder()
-      {}
+    static const std::size_t bufferSize = 32;
 
-    public: // queries
-      virtual const std::type_info & type() const = 0;
-      virtual placeholder * clone() const = 0;
-      virtual void printOn(std::ostream&) const = 0;
+    union storage {
+      void * pointer;
+      alignas(std::max_align_t) unsigned char buffer[bufferSize];
     };
-    template<typename ValueType>
-    class holder : public placeholder {
-    public: // structors
 
-      explicit holder(const ValueType & value) : held(value)
-      {}
+    struct operations_table {
+      const std::type_info & (*type)();
+      void (*clone)(const storage &, storage &);
+      void (*move)(storage &, storage &);
+      void (*destroy)(storage &);
+      void (*print)(const storage &, std::ostream &);
+    };
 
-    public: // queries
+    template<typename ValueType>
+    struct handler {
+      static const bool inplace = sizeof(ValueType) <= bufferSize &&
+        alignof(ValueType) <= alignof(std::max_align_t) &&
+        std::is_nothrow_move_constructible<ValueType>::value;
+
+      static ValueType * get(storage & s) {
+        return inplace ? reinterpret_cast<ValueType *>(s.buffer)
+               : static_cast<ValueType *>(s.pointer);
+      }
+      static const ValueType & get(const storage & s) {
+        return *get(const_cast<storage &>(s));
+      }
+      static void create(storage & s, const ValueType & value) {
+        if (inplace)
+          new (s.buffer) ValueType(value);
+        else
+          s.pointer = new ValueType(value);
+      }
 
-      virtual const std::type_info & type() const {
+      static const std::type_info & type() {
         return typeid(ValueType);
       }
-      virtual placeholder * clone() const {
-        return new holder(held);
+      static void clone(const storage & from, storage & to) {
+        create(to, get(from));
+      }
+      static void move(storage & from, storage & to) {
+        if (inplace) {
+          new (to.buffer) ValueType(std::move(*get(from)));
+          get(from)->~ValueType();
+        } else
+          to.pointer = from.pointer;
       }
-      virtual void printOn(std::ostream& os) const {
-        os << held;
+      static void destroy(storage & s) {
+        if (inplace)
+          get(s)->~ValueType();
+        else
+          delete get(s);
+      }
+      static void print(const storage & s, std::ostream & os) {
+        os << get(s);
       }
-    public: // representation
 
-      ValueType held;
+      static const operations_table operations;
     };
 
-  public:
-    placeholder * content;
+  private: // representation
+
+    const operations_table * table;
+    storage data;
 
   };
 
+  template<typename ValueType>
+  const Any::operations_table Any::handler<ValueType>::operations = {
+    &Any::handler<ValueType>::type,
+    &Any::handler<ValueType>::clone,
+    &Any::handler<ValueType>::move,
+    &Any::handler<ValueType>::destroy,
+    &Any::handler<ValueType>::print
+  };
+
   class bad_any_cast : public std::bad_cast {
   public:
     virtual const char * what() const throw() {
@@ -135,9 +209,7 @@ namespace any {
   template<typename ValueType>
   ValueType * any_cast(Any * operand)
   {
-    return operand && operand->type() == typeid(ValueType)
-           ? &static_cast<Any::holder<ValueType> *>(operand->content)->held
-           : 0;
+    return operand ? operand->get<ValueType>() : 0;
   }
 
   template<typename ValueType>
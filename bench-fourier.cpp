@@ -0,0 +1,446 @@
+/**************************************************************************
+ *
+ * $Id$
+ *
+ * Copyright (c) 2002-2011 Patrick Guio <patrick.guio@gmail.com>
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2.  of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************/
+
+/*
+ * Benchmark of the fourier transform classes
+ *
+ * Sweeps transform sizes, kinds (r2r, r2c, c2c), in-place and out-of-place
+ * classes, plan flags, batch sizes and thread counts. Every timed operation
+ * is a direct() followed by an inverse() so that the data stay bounded,
+ * times are reported per transform. The GFLOP/s figures use the usual
+ * 5 N log2(N) flop count for complex and 2.5 N log2(N) for real data. With
+ * the FFTW3 backend the bytes memcpy'd to and from the FFTW buffers are
+ * reported, together with the fraction of the transform time a memcpy of
+ * the same size takes. With counters=yes the IPC and the L1 data and last
+ * level cache misses per transformed element are read from the hardware
+ * counters when the kernel provides them.
+ *
+ * Example: bench-fourier sizes=1024,4096 kinds=c2c flags=estimate,measure
+ *          csv=fourier.csv baseline=fourier-ref.csv
+ *
+ */
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fourier.h>
+#include <parser.h>
+#include <bench-options.h>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+
+namespace {
+
+  typedef std::string string;
+  typedef fourier::complex complex;
+
+#if defined(HAVE_FFTW3_FFT)
+  template <class DFT>
+  void setPlanFlag(DFT &dft, unsigned flags)
+  {
+    dft.setPlanFlag(flags);
+  }
+  template <class DFT>
+  size_t stagingBytes(const DFT &dft)
+  {
+    return dft.stagingBytes();
+  }
+#else
+  template <class DFT>
+  void setPlanFlag(DFT &, unsigned)
+  {}
+  template <class DFT>
+  size_t stagingBytes(const DFT &)
+  {
+    return 0;
+  }
+#endif
+
+  template <class T_numtype>
+  void fill(blitz::Array<T_numtype,1> &x)
+  {
+    for (int i=0; i<x.rows(); ++i)
+      x(i) = std::sin(0.1*i)+0.5*std::cos(0.37*i);
+  }
+
+  template <class T_numtype>
+  void fill(blitz::Array<T_numtype,2> &x)
+  {
+    for (int j=0; j<x.cols(); ++j)
+      for (int i=0; i<x.rows(); ++i)
+        x(i,j) = std::sin(0.1*i+j)+0.5*std::cos(0.37*i);
+  }
+
+  // Round trip direct()/inverse() of one or batch columns in place
+  template <class In_numtype, class Out_numtype>
+  class InPlaceTest : public bench::Test {
+  public:
+    typedef fourier::InPlace<In_numtype, Out_numtype> DFT;
+
+    InPlaceTest(DFT &_dft, int n, int _batch, const string &_name) :
+      dft(_dft), batch(_batch), name(_name), x(n), xs(n, _batch) {
+      fill(x);
+      fill(xs);
+    }
+    void op() {
+      if (batch == 1) {
+        dft.direct(x);
+        dft.inverse(x);
+      } else {
+        dft.direct(xs);
+        dft.inverse(xs);
+      }
+      bench::clobberMemory();
+    }
+    std::string opName() const {
+      return name;
+    }
+  private:
+    DFT &dft;
+    int batch;
+    string name;
+    blitz::Array<In_numtype,1> x;
+    blitz::Array<In_numtype,2> xs;
+  };
+
+  // Round trip direct()/inverse() of one or batch columns out of place
+  template <class In_numtype, class Out_numtype>
+  class OutPlaceTest : public bench::Test {
+  public:
+    typedef fourier::OutPlace<In_numtype, Out_numtype> DFT;
+
+    OutPlaceTest(DFT &_dft, int n, int _batch, const string &_name) :
+      dft(_dft), batch(_batch), name(_name), x(n), y(n), xs(n, _batch),
+      ys(n, _batch) {
+      fill(x);
+      fill(xs);
+    }
+    void op() {
+      if (batch == 1) {
+        dft.direct(x, y);
+        dft.inverse(y, x);
+      } else {
+        dft.direct(xs, ys);
+        dft.inverse(ys, xs);
+      }
+      bench::clobberMemory();
+    }
+    std::string opName() const {
+      return name;
+    }
+  private:
+    DFT &dft;
+    int batch;
+    string name;
+    blitz::Array<In_numtype,1> x;
+    blitz::Array<Out_numtype,1> y;
+    blitz::Array<In_numtype,2> xs;
+    blitz::Array<Out_numtype,2> ys;
+  };
+
+  // The memcpy's of the staging of a round trip on its own
+  class CopyTest : public bench::Test {
+  public:
+    explicit CopyTest(size_t _bytes) : bytes(_bytes), a(_bytes), b(_bytes) {}
+    void op() {
+      for (int k=0; k<2; ++k) {
+        memcpy(&b[0], &a[0], bytes/2);
+        memcpy(&a[0], &b[0], bytes/2);
+      }
+      bench::clobberMemory();
+    }
+    std::string opName() const {
+      return "memcpy";
+    }
+  private:
+    size_t bytes;
+    std::vector<char> a, b;
+  };
+
+
+  class BenchFourier : public parser::Parser {
+  public:
+
+    BenchFourier(int nargs, char *args[]);
+
+    bool help() const {
+      return parseHelp() || parseVersion() || parseTemplate();
+    }
+    int run();
+
+  private:
+
+    enum parser_enum { _sizes=1, _kinds, _placements, _flags, _batches,
+                       _threads, _common };
+
+    std::vector<int> sizes;
+    std::vector<string> kinds;
+    std::vector<string> placements;
+    std::vector<string> flags;
+    std::vector<int> batches;
+    std::vector<int> threads;
+    bench::CommonOptions common;
+    bench::Report report;
+
+    void initParsing();
+    void paramParsing();
+
+    static bool knownKind(const string &name);
+    static bool planFlag(const string &name, unsigned &flags);
+
+    template <class In_numtype, class Out_numtype>
+    void measure(const string &kind, const string &place, int n,
+                 const string &flag, int batch, int nthreads);
+    void measure(const string &kind, const string &place, int n,
+                 const string &flag, int batch, int nthreads,
+                 bench::Test &test, size_t bytes, double flops);
+  };
+
+  BenchFourier::BenchFourier(int nargs, char *args[]) :
+    Parser(nargs, args), sizes(), kinds(), placements(), flags(), batches(),
+    threads(), common(), report()
+  {
+    // powers of two, primes and smooth composites
+    const int defSizes[] = { 64, 256, 1024, 4096, 16384, 65536, 262144,
+                             127, 1021, 8191, 65521,
+                             120, 1000, 5040, 46080
+                           };
+    sizes.assign(defSizes, defSizes+sizeof(defSizes)/sizeof(defSizes[0]));
+#if defined(HAVE_FFTW3_FFT)
+    const char *defKinds[] = { "r2r", "r2c", "c2c" };
+#else
+    const char *defKinds[] = { "r2r", "c2c" };
+#endif
+    kinds.assign(defKinds, defKinds+sizeof(defKinds)/sizeof(defKinds[0]));
+    placements.push_back("in");
+    placements.push_back("out");
+#if defined(HAVE_FFTW3_FFT)
+    flags.push_back("estimate");
+    flags.push_back("measure");
+#else
+    flags.push_back("default");
+#endif
+    batches.push_back(1);
+    batches.push_back(16);
+    threads.push_back(1);
+    common.opt.samples = 20;
+    common.opt.warmupTime = 0.05;
+
+    initParsing();
+    paramParsing();
+  }
+
+  void BenchFourier::initParsing()
+  {
+    using namespace parser::types;
+    registerProgram("bench-fourier");
+    insertOption(_sizes, "sizes", intVect,
+                 "Transform sizes (default 2^n, primes and smooth "
+                 "composites)", Any());
+    insertOption(_kinds, "kinds", stringVect,
+                 "Transform kinds r2r, r2c, c2c", Any());
+    insertOption(_placements, "placements", stringVect,
+                 "in (IDFT1D), out (ODFT1D) or both", Any());
+    insertOption(_flags, "flags", stringVect,
+                 "FFTW3 plan flags estimate, measure, patient, exhaustive",
+                 Any());
+    insertOption(_batches, "batches", intVect,
+                 "Number of columns transformed per call", Any());
+    insertOption(_threads, "threads", intVect,
+                 "Number of FFTW3 threads", Any());
+    common.insertOptions(*this, _common);
+  }
+
+  void BenchFourier::paramParsing()
+  {
+    std::vector<int> vi;
+    std::vector<string> vs;
+    if (parseOption(_sizes, vi))
+      sizes = vi;
+    // unknown kinds and plan flags dropped once here
+    if (parseOption(_kinds, vs)) {
+      kinds.clear();
+      for (size_t k=0; k<vs.size(); ++k)
+        if (knownKind(vs[k]))
+          kinds.push_back(vs[k]);
+        else
+          cerr << "bench-fourier: skipping unknown kind " << vs[k] << endl;
+    }
+    if (parseOption(_placements, vs))
+      placements = vs;
+    if (parseOption(_flags, vs)) {
+      flags.clear();
+      unsigned f;
+      for (size_t k=0; k<vs.size(); ++k)
+        if (planFlag(vs[k], f))
+          flags.push_back(vs[k]);
+        else
+          cerr << "bench-fourier: skipping unknown plan flag " << vs[k]
+               << endl;
+    }
+    if (parseOption(_batches, vi))
+      batches = vi;
+    if (parseOption(_threads, vi))
+      threads = vi;
+    common.parseOptions(*this, _common);
+  }
+
+  bool BenchFourier::knownKind(const string &name)
+  {
+#if defined(HAVE_FFTW3_FFT)
+    if (name == "r2c")
+      return true;
+#endif
+    return name == "r2r" || name == "c2c";
+  }
+
+  bool BenchFourier::planFlag(const string &name, unsigned &flags)
+  {
+#if defined(HAVE_FFTW3_FFT)
+    if (name == "estimate")
+      flags = FFTW_ESTIMATE;
+    else if (name == "measure")
+      flags = FFTW_MEASURE;
+    else if (name == "patient")
+      flags = FFTW_PATIENT;
+    else if (name == "exhaustive")
+      flags = FFTW_EXHAUSTIVE;
+    else
+      return false;
+    return true;
+#else
+    flags = 0;
+    return name == "default";
+#endif
+  }
+
+  template <class In_numtype, class Out_numtype>
+  void BenchFourier::measure(const string &kind, const string &place, int n,
+                             const string &flag, int batch, int nthreads)
+  {
+    unsigned f;
+    planFlag(flag, f);
+#if defined(HAVE_FFTW3_THREADS)
+    fourier::setPlanThreads(nthreads);
+#endif
+    // 5 N log2(N) for complex transforms, half of it for real ones
+    double flops = (kind == "c2c" ? 5.0 : 2.5)*n*std::log(double(n))/
+                   std::log(2.0);
+    if (place == "in") {
+      fourier::IDFT1D<In_numtype, Out_numtype> dft(n);
+      setPlanFlag(dft, f);
+      InPlaceTest<In_numtype, Out_numtype> test(dft, n, batch, kind);
+      measure(kind, place, n, flag, batch, nthreads, test,
+              batch*stagingBytes(dft), flops);
+    } else {
+      fourier::ODFT1D<In_numtype, Out_numtype> dft(n);
+      setPlanFlag(dft, f);
+      OutPlaceTest<In_numtype, Out_numtype> test(dft, n, batch, kind);
+      measure(kind, place, n, flag, batch, nthreads, test,
+              batch*stagingBytes(dft), flops);
+    }
+  }
+
+  void BenchFourier::measure(const string &kind, const string &place, int n,
+                             const string &flag, int batch, int nthreads,
+                             bench::Test &test, size_t bytes, double flops)
+  {
+    std::ostringstream params;
+    params << "place=" << place << " n=" << n << " flag=" << flag
+           << " batch=" << batch << " threads=" << nthreads;
+    // two transforms of batch columns per op
+    bench::Stats s = report.run(test, params.str(), common.opt);
+    double t = s.median/(2.0*batch);
+    double tcopy = 0.0;
+    if (bytes > 0) {
+      CopyTest copy(bytes);
+      tcopy = bench::benchClassStats(copy, common.opt).median/(2.0*batch);
+    }
+    std::ios::fmtflags fl = cout.flags();
+    std::streamsize p = cout.precision();
+    cout << std::left << std::setw(4) << kind << std::setw(4) << place
+         << std::right << std::setw(8) << n << std::setw(11) << flag
+         << std::setw(6) << batch << std::setw(4) << nthreads
+         << std::setw(14) << timeutils::smartTime(t)
+         << std::fixed << std::setprecision(3)
+         << std::setw(10) << 1.0e-9*flops/t
+         << std::setw(12) << bytes/batch
+         << std::setprecision(1) << std::setw(8) << 100.0*tcopy/t;
+    if (common.opt.counters)
+      bench::printCounters(cout, s, 2.0*batch*n);
+    cout << endl;
+    cout.flags(fl);
+    cout.precision(p);
+  }
+
+  int BenchFourier::run()
+  {
+    cout << "kind/place       n       flag batch thr  time/transform"
+         << "   GFLOP/s  bytes/copy  copy %";
+    if (common.opt.counters)
+      cout << bench::countersHeader();
+    cout << endl;
+    for (size_t k=0; k<kinds.size(); ++k)
+      for (size_t p=0; p<placements.size(); ++p)
+        for (size_t i=0; i<sizes.size(); ++i)
+          for (size_t f=0; f<flags.size(); ++f)
+            for (size_t b=0; b<batches.size(); ++b)
+              for (size_t t=0; t<threads.size(); ++t) {
+                const string &kind = kinds[k], &place = placements[p];
+                if (kind == "r2r")
+                  measure<double, double>(kind, place, sizes[i], flags[f],
+                                          batches[b], threads[t]);
+#if defined(HAVE_FFTW3_FFT)
+                else if (kind == "r2c")
+                  measure<double, complex>(kind, place, sizes[i], flags[f],
+                                           batches[b], threads[t]);
+#endif
+                else
+                  measure<complex, complex>(kind, place, sizes[i], flags[f],
+                                            batches[b], threads[t]);
+              }
+
+    return common.writeReports(report, cout);
+  }
+
+}
+
+int main(int nargs, char *args[])
+{
+  try {
+    BenchFourier b(nargs, args);
+    if (b.help())
+      return EXIT_SUCCESS;
+    return b.run();
+  } catch (ClassException &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+}
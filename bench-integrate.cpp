@@ -0,0 +1,397 @@
+/**************************************************************************
+ *
+ * $Id$
+ *
+ * Copyright (c) 2002-2011 Patrick Guio <patrick.guio@gmail.com>
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2.  of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************/
+
+/*
+ * Benchmark of the non-FFT numerical kernels
+ *
+ * integrate() for float (accumulated in float and in double) and double
+ * fields of rank 1 to 3 with cubic, slab and pencil shapes in C and
+ * Fortran storage order, the binomial filters and fftshift/ifftshift.
+ * Throughput is reported in elements/s together with the effective memory
+ * bandwidth, i.e. the bytes the kernel has to read and write divided by
+ * its time, and its ratio to the bandwidth of a STREAM triad
+ * a(i) = b(i)+s*c(i) measured first on the same host. With counters=yes
+ * the IPC and the L1 data and last level cache misses per element are
+ * added from the hardware counters when the kernel provides them.
+ *
+ * Example: bench-integrate n3=65,129 orders=c csv=integrate.csv
+ *
+ */
+
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <integrate.h>
+#include <fourier.h>
+#include <parser.h>
+#include <bench-options.h>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+
+namespace {
+
+  typedef std::string string;
+
+  // Kernel with its data volume, for elements/s and bandwidth
+  class KernelTest : public bench::Test {
+  public:
+    KernelTest(const string &_name, double _elements, double _bytes) :
+      name(_name), elements(_elements), bytes(_bytes) {}
+    std::string opName() const {
+      return name;
+    }
+    double getElements() const {
+      return elements;
+    }
+    double getBytes() const {
+      return bytes;
+    }
+  private:
+    string name;
+    double elements;
+    double bytes;
+  };
+
+  class StreamTriad : public KernelTest {
+  public:
+    explicit StreamTriad(int n) :
+      KernelTest("triad", n, 3.0*sizeof(double)*n), a(n, 1.0), b(n, 2.0),
+      c(n, 0.5) {}
+    void op() {
+      const double s = 3.0;
+      double *pa = &a[0];
+      const double *pb = &b[0], *pc = &c[0];
+      const size_t n = a.size();
+      for (size_t i=0; i<n; ++i)
+        pa[i] = pb[i]+s*pc[i];
+      bench::clobberMemory();
+    }
+  private:
+    std::vector<double> a, b, c;
+  };
+
+  template <class T_numtype, class T_accum, int N_rank>
+  class IntegrateTest : public KernelTest {
+  public:
+    IntegrateTest(const string &name,
+                  const blitz::TinyVector<int,N_rank> &shape,
+                  const blitz::GeneralArrayStorage<N_rank> &storage) :
+      KernelTest(name, product(shape), sizeof(T_numtype)*product(shape)),
+      F(shape, storage), dr() {
+      T_numtype *p = F.data();
+      const long n = F.numElements();
+      for (long i=0; i<n; ++i)
+        p[i] = 1.0+0.1*std::sin(0.001*i);
+      for (int d=0; d<N_rank; ++d)
+        dr(d) = 1.0/(shape(d)-1);
+    }
+    void op() {
+      T_accum dI;
+      T_accum I = integrate(F, dr, dI);
+      bench::doNotOptimize(I);
+      bench::doNotOptimize(dI);
+    }
+  private:
+    blitz::Array<T_numtype,N_rank> F;
+    blitz::TinyVector<T_accum,N_rank> dr;
+
+    static double product(const blitz::TinyVector<int,N_rank> &shape) {
+      double n = 1.0;
+      for (int d=0; d<N_rank; ++d)
+        n *= shape(d);
+      return n;
+    }
+  };
+
+  // binom2filter() to binom8filter() and fftshift()/ifftshift(), all of
+  // which read and write n elements. The filter is chosen by name once,
+  // so that op() times the kernel only.
+  template <class T_numtype>
+  class Filter1DTest : public KernelTest {
+  public:
+    Filter1DTest(const string &name, int n) :
+      KernelTest(name, n, 2.0*sizeof(T_numtype)*n), f(n),
+      filter(select(name)) {
+      for (int i=0; i<n; ++i)
+        f(i) = std::sin(0.01*i);
+    }
+    void op() {
+      blitz::Array<T_numtype,1> r;
+      r.reference((this->*filter)());
+      bench::doNotOptimize(r.data());
+      bench::clobberMemory();
+    }
+  private:
+    typedef blitz::Array<T_numtype,1> Array;
+    typedef Array (Filter1DTest::*Filter)();
+
+    Array f;
+    Filter filter;
+
+    Array binom2() {
+      return fourier::binom2filter(f, T_numtype(0));
+    }
+    Array binom4() {
+      return fourier::binom4filter(f, T_numtype(0));
+    }
+    Array binom6() {
+      return fourier::binom6filter(f, T_numtype(0));
+    }
+    Array binom8() {
+      return fourier::binom8filter(f, T_numtype(0));
+    }
+    Array shift() {
+      return fourier::fftshift(f);
+    }
+    Array ishift() {
+      return fourier::ifftshift(f);
+    }
+    static Filter select(const string &name) {
+      if (name == "binom2")
+        return &Filter1DTest::binom2;
+      if (name == "binom4")
+        return &Filter1DTest::binom4;
+      if (name == "binom6")
+        return &Filter1DTest::binom6;
+      if (name == "binom8")
+        return &Filter1DTest::binom8;
+      if (name == "fftshift")
+        return &Filter1DTest::shift;
+      return &Filter1DTest::ishift;
+    }
+  };
+
+
+  class BenchIntegrate : public parser::Parser {
+  public:
+
+    BenchIntegrate(int nargs, char *args[]);
+
+    bool help() const {
+      return parseHelp() || parseVersion() || parseTemplate();
+    }
+    int run();
+
+  private:
+
+    enum parser_enum { _n1=1, _n2, _n3, _orders, _filterSizes, _streamSize,
+                       _common };
+
+    std::vector<int> n1, n2, n3;
+    std::vector<string> orders;
+    std::vector<int> filterSizes;
+    int streamSize;
+    bench::CommonOptions common;
+    bench::Report report;
+    double triad;
+
+    void initParsing();
+    void paramParsing();
+
+    void measure(KernelTest &test, const string &params);
+
+    template <int N_rank>
+    void integrateShapes(const std::vector<int> &sizes);
+    template <int N_rank>
+    void integrateTypes(const blitz::TinyVector<int,N_rank> &shape,
+                        const string &shapeName);
+  };
+
+  BenchIntegrate::BenchIntegrate(int nargs, char *args[]) :
+    Parser(nargs, args), n1(), n2(), n3(), orders(), filterSizes(),
+    streamSize(1<<22), common(), report(), triad(0.0)
+  {
+    n1.push_back(1025);
+    n1.push_back(1048577);
+    n2.push_back(129);
+    n2.push_back(1025);
+    n3.push_back(33);
+    n3.push_back(129);
+    orders.push_back("c");
+    orders.push_back("fortran");
+    filterSizes.push_back(1024);
+    filterSizes.push_back(1048576);
+    common.opt.samples = 20;
+    common.opt.warmupTime = 0.05;
+
+    initParsing();
+    paramParsing();
+  }
+
+  void BenchIntegrate::initParsing()
+  {
+    using namespace parser::types;
+    registerProgram("bench-integrate");
+    insertOption(_n1, "n1", intVect,
+                 "Number of points of 1-d integrals", Any());
+    insertOption(_n2, "n2", intVect,
+                 "Number of points per dimension of 2-d integrals", Any());
+    insertOption(_n3, "n3", intVect,
+                 "Number of points per dimension of 3-d integrals", Any());
+    insertOption(_orders, "orders", stringVect,
+                 "Storage orders c, fortran", Any());
+    insertOption(_filterSizes, "filter_sizes", intVect,
+                 "Sizes for the binomial filters and fftshift", Any());
+    insertOption(_streamSize, "stream_size", integer,
+                 "Array size of the STREAM triad", Any(streamSize));
+    common.insertOptions(*this, _common);
+  }
+
+  void BenchIntegrate::paramParsing()
+  {
+    std::vector<int> vi;
+    std::vector<string> vs;
+    if (parseOption(_n1, vi))
+      n1 = vi;
+    if (parseOption(_n2, vi))
+      n2 = vi;
+    if (parseOption(_n3, vi))
+      n3 = vi;
+    if (parseOption(_orders, vs))
+      orders = vs;
+    if (parseOption(_filterSizes, vi))
+      filterSizes = vi;
+    parseOption(_streamSize, streamSize);
+    common.parseOptions(*this, _common);
+  }
+
+  void BenchIntegrate::measure(KernelTest &test, const string &params)
+  {
+    bench::Stats s = report.run(test, params, common.opt);
+    double t = s.median;
+    double bw = test.getBytes()/t;
+    // the triad is measured first and is the reference
+    if (triad == 0.0)
+      triad = bw;
+    std::ios::fmtflags f = cout.flags();
+    std::streamsize p = cout.precision();
+    cout << std::left << std::setw(20) << test.opName() << std::setw(28)
+         << params << std::right << std::setw(14)
+         << timeutils::smartTime(t) << std::scientific
+         << std::setprecision(3) << std::setw(12) << test.getElements()/t
+         << std::fixed << std::setprecision(2) << std::setw(9) << 1.0e-9*bw
+         << std::setprecision(1) << std::setw(8) << 100.0*bw/triad;
+    if (common.opt.counters)
+      bench::printCounters(cout, s, test.getElements());
+    cout << endl;
+    cout.flags(f);
+    cout.precision(p);
+  }
+
+  template <int N_rank>
+  void BenchIntegrate::integrateTypes(const blitz::TinyVector<int,N_rank> &
+                                      shape, const string &shapeName)
+  {
+    for (size_t o=0; o<orders.size(); ++o) {
+      blitz::GeneralArrayStorage<N_rank> storage;
+      if (orders[o] == "fortran")
+        storage = blitz::ColumnMajorArray<N_rank>();
+      else if (orders[o] != "c") {
+        cerr << "bench-integrate: skipping unknown order " << orders[o]
+             << endl;
+        continue;
+      }
+      std::ostringstream params;
+      params << N_rank << "d " << shapeName << ' ' << orders[o];
+      for (int d=0; d<N_rank; ++d)
+        params << (d ? "x" : " ") << shape(d);
+      IntegrateTest<float, float, N_rank> ff("integrate-float", shape,
+                                             storage);
+      measure(ff, params.str());
+      IntegrateTest<float, double, N_rank> fd("integrate-float/dbl", shape,
+                                              storage);
+      measure(fd, params.str());
+      IntegrateTest<double, double, N_rank> dd("integrate-double", shape,
+                                               storage);
+      measure(dd, params.str());
+    }
+  }
+
+  // Cubic n^N, slab (last dimension 9) and pencil (first dimension 9)
+  // shapes for every size
+  template <int N_rank>
+  void BenchIntegrate::integrateShapes(const std::vector<int> &sizes)
+  {
+    for (size_t i=0; i<sizes.size(); ++i) {
+      blitz::TinyVector<int,N_rank> shape(sizes[i]);
+      integrateTypes(shape, "cube");
+      if (N_rank > 1) {
+        shape(N_rank-1) = 9;
+        integrateTypes(shape, "slab");
+        shape(N_rank-1) = sizes[i];
+        shape(0) = 9;
+        integrateTypes(shape, "pencil");
+      }
+    }
+  }
+
+  int BenchIntegrate::run()
+  {
+    cout << "kernel              parameters                  time/op"
+         << "      elements/s     GB/s  triad %";
+    if (common.opt.counters)
+      cout << bench::countersHeader();
+    cout << endl;
+
+    StreamTriad stream(streamSize);
+    std::ostringstream params;
+    params << "n=" << streamSize;
+    measure(stream, params.str());
+
+    integrateShapes<1>(n1);
+    integrateShapes<2>(n2);
+    integrateShapes<3>(n3);
+
+    const char *filters[] = { "binom2", "binom4", "binom6", "binom8",
+                              "fftshift", "ifftshift"
+                            };
+    for (size_t i=0; i<filterSizes.size(); ++i)
+      for (size_t k=0; k<sizeof(filters)/sizeof(filters[0]); ++k) {
+        std::ostringstream p;
+        p << "n=" << filterSizes[i];
+        Filter1DTest<double> f(filters[k], filterSizes[i]);
+        measure(f, p.str());
+      }
+
+    return common.writeReports(report, cout);
+  }
+
+}
+
+int main(int nargs, char *args[])
+{
+  try {
+    BenchIntegrate b(nargs, args);
+    if (b.help())
+      return EXIT_SUCCESS;
+    return b.run();
+  } catch (ClassException &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+}
@@ -0,0 +1,159 @@
+/**************************************************************************
+ *
+ * $Id$
+ *
+ * Copyright (c) 2002-2011 Patrick Guio <patrick.guio@gmail.com>
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2.  of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************/
+
+#ifndef BENCH_OPTIONS_H
+#define BENCH_OPTIONS_H
+
+#include <bench.h>
+#include <parser.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <ostream>
+#include <string>
+
+namespace bench {
+
+  // Options common to the benchmark programs, registered in their
+  // parser::Parser with the keys first to first+numKeys-1 and parsed with
+  // the program options:
+  //
+  //   common.insertOptions(*this, _common);
+  //   common.parseOptions(*this, _common);
+  //   report.run(test, params, common.opt);
+  //   return common.writeReports(report, std::cout);
+  struct CommonOptions {
+#if defined(HAVE_ANY_NAMESPACE)
+    typedef any::Any Any;
+#endif
+    enum { numKeys = 9 };
+
+    Options opt;
+    std::string clock;
+    std::string jsonFile, csvFile, baselineFile;
+    double threshold;   // relative slow down reported as regression
+
+    CommonOptions() : opt(), clock("process"), jsonFile(), csvFile(),
+      baselineFile(), threshold(0.05) {}
+
+    template <class Parser>
+    void insertOptions(Parser &p, int first) const {
+      using namespace parser::types;
+      p.insertOption(first, "sample_time", real,
+                     "Time per sample in s", Any(opt.sampleTime));
+      p.insertOption(first+1, "samples", integer,
+                     "Number of samples", Any(opt.samples));
+      p.insertOption(first+2, "warmup_time", real,
+                     "Warm-up time in s", Any(opt.warmupTime));
+      p.insertOption(first+3, "clock", charStr,
+                     "Timer clock times, monotonic, process, thread or tsc",
+                     Any(clock));
+      p.insertOption(first+4, "counters", boolean,
+                     "Read the hardware performance counters",
+                     Any(opt.counters));
+      p.insertOption(first+5, "json", charStr,
+                     "Write results to JSON file", Any());
+      p.insertOption(first+6, "csv", charStr,
+                     "Write results to CSV file", Any());
+      p.insertOption(first+7, "baseline", charStr,
+                     "Compare with baseline CSV file", Any());
+      p.insertOption(first+8, "threshold", real,
+                     "Relative slow down reported as regression",
+                     Any(threshold));
+    }
+
+    // Also sets the default clock of the timers
+    template <class Parser>
+    void parseOptions(const Parser &p, int first) {
+      p.parseOption(first, opt.sampleTime);
+      p.parseOption(first+1, opt.samples);
+      p.parseOption(first+2, opt.warmupTime);
+      p.parseOption(first+3, clock);
+      p.parseOption(first+4, opt.counters);
+      p.parseOption(first+5, jsonFile);
+      p.parseOption(first+6, csvFile);
+      p.parseOption(first+7, baselineFile);
+      p.parseOption(first+8, threshold);
+
+      timeutils::Timer::clockType c;
+      if (!timeutils::Timer::clockFromName(clock, c))
+        throw parser::ParserException("Unknown clock '" + clock + "'");
+      timeutils::Timer::setDefaultClock(c);
+    }
+
+    // Write the JSON and CSV files and compare with the baseline, returns
+    // the exit status of the program
+    int writeReports(const Report &report, std::ostream &os) const {
+      if (!jsonFile.empty()) {
+        std::ofstream json(jsonFile.c_str());
+        report.writeJSON(json);
+      }
+      if (!csvFile.empty()) {
+        std::ofstream csv(csvFile.c_str());
+        report.writeCSV(csv);
+      }
+      if (!baselineFile.empty())
+        return report.compare(baselineFile, os, threshold) != 0 ?
+               EXIT_FAILURE : EXIT_SUCCESS;
+      return EXIT_SUCCESS;
+    }
+  };
+
+  // Header of the columns written by printCounters()
+  inline const char *countersHeader()
+  {
+    return "   IPC   L1D/elt   LLC/elt";
+  }
+
+  // IPC and L1 data and last level cache misses per element of a result,
+  // "-" for the counters that are not available
+  inline void printCounters(std::ostream &os, const Stats &s,
+                            double elements)
+  {
+    using perfcounters::Counters;
+    double l1 = s.count(Counters::l1dMisses);
+    double llc = s.count(Counters::llcMisses);
+    std::ios::fmtflags f = os.flags();
+    std::streamsize p = os.precision();
+    os << std::fixed << std::setprecision(2) << std::setw(6);
+    if (s.ipc() >= 0.0)
+      os << s.ipc();
+    else
+      os << "-";
+    os << std::setprecision(4) << std::setw(10);
+    if (l1 >= 0.0)
+      os << l1/elements;
+    else
+      os << "-";
+    os << std::setw(10);
+    if (llc >= 0.0)
+      os << llc/elements;
+    else
+      os << "-";
+    os.flags(f);
+    os.precision(p);
+  }
+
+} // namespace bench
+
+#endif // BENCH_OPTIONS_H
@@ -25,14 +25,23 @@
 #define BENCH_H
 
 #include <time-utils.h>
+#include <perf-counters.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <map>
 #include <sstream>
 #include <string>
+#include <vector>
+#include <sys/param.h>
+#include <unistd.h>
 
 namespace bench {
 
-#if 1
-
   static bool verbose = false;
 
   struct Test {
@@ -42,77 +51,584 @@ namespace bench {
     virtual std::string opName() const = 0;
   };
 
-  template <class Test>
-  double  benchClassOp(Test & test, double minTime, int repeatTime=1)
+  // Optimizer barriers: doNotOptimize(x) forces x to be computed and kept,
+  // clobberMemory() forces pending writes to memory to be performed.
+#if defined(__GNUC__)
+  template <class T>
+  inline void doNotOptimize(const T &value)
+  {
+    asm volatile("" : : "r,m"(value) : "memory");
+  }
+  inline void clobberMemory()
+  {
+    asm volatile("" : : : "memory");
+  }
+#else
+  template <class T>
+  inline void doNotOptimize(const T &value)
+  {
+    static volatile const void *sink;
+    sink = &value;
+  }
+  inline void clobberMemory()
+  {
+    static volatile int sink;
+    sink = 0;
+  }
+#endif
+
+  struct Options {
+    double warmupTime;  // s spent running the op before measuring
+    double sampleTime;  // target s per sample, sets the batch size
+    int samples;        // number of timed batches
+    int resamples;      // bootstrap resamples for the confidence interval
+    double confidence;  // level of the confidence interval of the median
+    bool cpuTime;       // measure user time instead of real time
+    bool counters;      // read the hardware counters of the samples
+    Options() : warmupTime(0.1), sampleTime(0.01), samples(30),
+      resamples(1000), confidence(0.95), cpuTime(false), counters(false) {}
+  };
+
+  // Statistics of the time per op over the samples, in s
+  struct Stats {
+    int samples;
+    long batch;
+    double mean, stddev;
+    double min, max;
+    double median;
+    double mad;         // median absolute deviation from the median
+    double p05, p25, p75, p95;
+    double ciLow, ciHigh;
+    int outliers;       // samples further than 3 scaled MADs from the median
+    // hardware counts per op over all samples, negative if not available
+    double counts[perfcounters::Counters::numEvents];
+    Stats() : samples(0), batch(0), mean(0), stddev(0), min(0), max(0),
+      median(0), mad(0), p05(0), p25(0), p75(0), p95(0), ciLow(0),
+      ciHigh(0), outliers(0) {
+      for (int e=0; e<perfcounters::Counters::numEvents; ++e)
+        counts[e] = -1.0;
+    }
+    double count(perfcounters::Counters::eventType e) const {
+      return counts[e];
+    }
+    double ipc() const {
+      using perfcounters::Counters;
+      if (counts[Counters::cycles] > 0.0 &&
+          counts[Counters::instructions] >= 0.0)
+        return counts[Counters::instructions]/counts[Counters::cycles];
+      return -1.0;
+    }
+
+    friend std::ostream& operator<<(std::ostream &os, const Stats &x) {
+      using timeutils::smartTime;
+      os << smartTime(x.median) << " +/- " << smartTime(x.mad)
+         << " [" << smartTime(x.ciLow) << ", " << smartTime(x.ciHigh)
+         << "] (" << x.samples << " x " << x.batch << ", "
+         << x.outliers << " outliers)";
+      if (x.ipc() >= 0.0)
+        os << " IPC " << x.ipc();
+      return os;
+    }
+  };
+
+  // Percentile q in [0,1] of sorted x, linearly interpolated
+  inline double percentile(const std::vector<double> &x, double q)
   {
+    double r = q*(x.size()-1);
+    size_t i = static_cast<size_t>(r);
+    if (i+1 >= x.size())
+      return x.back();
+    return x[i]+(r-i)*(x[i+1]-x[i]);
+  }
+
+  inline Stats statistics(const std::vector<double> &x, long batch,
+                          const Options &opt=Options())
+  {
+    Stats s;
+    s.samples = x.size();
+    s.batch = batch;
+    if (x.empty())
+      return s;
+    std::vector<double> y(x);
+    std::sort(y.begin(), y.end());
+    double sum = 0.0, sum2 = 0.0;
+    for (size_t i=0; i<y.size(); ++i) {
+      sum += y[i];
+      sum2 += y[i]*y[i];
+    }
+    s.mean = sum/y.size();
+    s.stddev = std::sqrt(std::max(0.0, sum2/y.size()-s.mean*s.mean));
+    s.min = y.front();
+    s.max = y.back();
+    s.median = percentile(y, 0.5);
+    s.p05 = percentile(y, 0.05);
+    s.p25 = percentile(y, 0.25);
+    s.p75 = percentile(y, 0.75);
+    s.p95 = percentile(y, 0.95);
+
+    std::vector<double> d(y.size());
+    for (size_t i=0; i<y.size(); ++i)
+      d[i] = std::fabs(y[i]-s.median);
+    std::sort(d.begin(), d.end());
+    s.mad = percentile(d, 0.5);
+    for (size_t i=0; i<d.size(); ++i)
+      if (d[i] > 3.0*1.4826*s.mad)
+        ++s.outliers;
+
+    // Bootstrap of the median with a fixed seed linear congruential
+    // generator so that repeated analyses give the same interval
+    std::vector<double> m(opt.resamples), r(y.size());
+    unsigned long long seed = 0x2545F4914F6CDD1DULL;
+    for (int k=0; k<opt.resamples; ++k) {
+      for (size_t i=0; i<r.size(); ++i) {
+        seed = seed*6364136223846793005ULL+1442695040888963407ULL;
+        r[i] = y[(seed >> 33) % y.size()];
+      }
+      std::sort(r.begin(), r.end());
+      m[k] = percentile(r, 0.5);
+    }
+    if (m.empty()) {
+      s.ciLow = s.ciHigh = s.median;
+    } else {
+      std::sort(m.begin(), m.end());
+      s.ciLow = percentile(m, 0.5*(1.0-opt.confidence));
+      s.ciHigh = percentile(m, 0.5*(1.0+opt.confidence));
+    }
+    return s;
+  }
+
+  // Drives the timed loop of a benchmark through warm-up, batch size
+  // calibration and sampling:
+  //
+  //   for (bench::Runner run(opt); run.running(); ) {
+  //     long n = run.batch();
+  //     run.start();
+  //     for (long i=0; i<n; ++i)
+  //       op();
+  //     run.stop();
+  //   }
+  //   std::cout << run.stats() << std::endl;
+  //
+  // During warm-up the batch size doubles, the last warm-up batch then
+  // gives the batch size needed for one sample to last opt.sampleTime,
+  // but at least 1000 ticks of the clock measured, real or user time,
+  // and no more than maxFloor s. A raised sample time is reported once.
+  class Runner {
+  public:
+    enum { maxFloor = 1 };
+
+    explicit Runner(const Options &_opt=Options()) :
+      opt(_opt), phase(warmup), ni(1), warmupElapsed(0.0),
+      counters(_opt.counters), ops(0.0) {
+      for (int e=0; e<perfcounters::Counters::numEvents; ++e)
+        counts[e] = 0.0;
+      double tick = opt.cpuTime ? timer.userResolution() : timer.resolution();
+      double least = std::min(1000.0*tick, static_cast<double>(maxFloor));
+      if (opt.sampleTime < least) {
+        static bool reported = false;
+        if (!reported)
+          std::cerr << "bench: sample time raised from "
+                    << timeutils::smartTime(opt.sampleTime) << " to "
+                    << timeutils::smartTime(least) << " for the "
+                    << timeutils::smartTime(tick) << " resolution of the "
+                    << timeutils::Timer::clockName(timer.getClock())
+                    << " clock" << std::endl;
+        reported = true;
+        opt.sampleTime = least;
+      }
+      if (opt.samples < 1)
+        opt.samples = 1;
+      times.reserve(opt.samples);
+    }
+    bool running() const {
+      return phase != done;
+    }
+    long batch() const {
+      return ni;
+    }
+    void start() {
+      if (phase == sampling)
+        counters.start();
+      timer.start();
+    }
+    void stop() {
+      timer.stop();
+      if (phase == sampling)
+        count();
+      double t = (opt.cpuTime ? timer.userElapsed() : timer.realElapsed());
+      if (phase == warmup) {
+        warmupElapsed += t;
+        if (warmupElapsed < opt.warmupTime || t < 1.0e-3*opt.sampleTime) {
+          ni <<= 1;
+        } else {
+          double n = std::ceil(opt.sampleTime*ni/std::max(t, 1.0e-12));
+          ni = std::max(1L, static_cast<long>(n));
+          phase = sampling;
+        }
+      } else {
+        times.push_back(t/ni);
+        if (static_cast<int>(times.size()) >= opt.samples) {
+          result = statistics(times, ni, opt);
+          for (int e=0; e<perfcounters::Counters::numEvents; ++e)
+            if (counts[e] >= 0.0)
+              result.counts[e] = counts[e]/ops;
+          phase = done;
+        }
+      }
+    }
+    const Stats &stats() const {
+      return result;
+    }
+    const std::vector<double> &samples() const {
+      return times;
+    }
+  private:
+    enum runPhase { warmup, sampling, done };
+    Options opt;
+    runPhase phase;
+    long ni;
+    double warmupElapsed;
     timeutils::Timer timer;
-    double avOneOpTime=0;
-
-    for (int r=0; r<repeatTime; ++r) {
-      double oneOpTime;
-      double totalTime;
-      int ni = 1;
-      do {
-        timer.start();
-        for (int i = 0; i < ni; ++i)
-          test.op();
-        timer.stop();
-        oneOpTime = (totalTime=(timer.userElapsed())) / ni;
-        ni <<= 1;
-      } while (totalTime < minTime);
-      avOneOpTime += oneOpTime;
-    }
-    avOneOpTime /= double(repeatTime);
+    std::vector<double> times;
+    Stats result;
+    perfcounters::Counters counters;
+    double counts[perfcounters::Counters::numEvents];
+    double ops;
 
+    // an event missing in any sample is not available
+    void count() {
+      counters.stop();
+      for (int e=0; e<perfcounters::Counters::numEvents; ++e) {
+        double v = counters.value(static_cast<perfcounters::Counters::
+                                  eventType>(e));
+        if (v < 0.0 || counts[e] < 0.0)
+          counts[e] = -1.0;
+        else
+          counts[e] += v;
+      }
+      ops += ni;
+    }
+
+    Runner(const Runner &);
+    Runner &operator=(const Runner &);
+  };
+
+  // Statistics of the time per call of test.op(), the time per call of
+  // each sample is also returned in samples if given
+  template <class Test>
+  Stats benchClassStats(Test & test, const Options &opt=Options(),
+                        std::vector<double> *samples=0)
+  {
+    Runner run(opt);
+    while (run.running()) {
+      long ni = run.batch();
+      run.start();
+      for (long i = 0; i < ni; ++i)
+        test.op();
+      run.stop();
+    }
     if (verbose)
       std::cout << "time for one '" << test.opName() << "' = "
-                << timeutils::smartTime(avOneOpTime) << std::endl;
-    return avOneOpTime;
+                << run.stats() << std::endl;
+    if (samples)
+      *samples = run.samples();
+    return run.stats();
   }
 
-#define BENCH(block,name,mintime,t)                                  \
-{                                                                    \
-	timeutils::Timer timer;                                            \
-	double total_t;                                                    \
-	int ni = 1;                                                        \
-	do {                                                               \
-		timer.start();                                                   \
-		for (int i = 0; i < ni; ++i) {                                   \
-			block                                                          \
-	}                                                                  \
-	timer.stop();                                                      \
-	t = (total_t=(timer.userElapsed())) / ni;                          \
-	ni <<= 1;                                                          \
-	} while (total_t < mintime);                                       \
-	if (bench::verbose)                                                \
-	  std::cout << "time for one " << name << " = "                    \
-		        << timeutils::smartTime(t) << std::endl;                 \
-}                                                                    \
- 
-#else
+  // Median user time per call of test.op(), as measured before the
+  // Runner, sampled repeatTime*10 times over about repeatTime*minTime
+  // seconds after warm-up
+  template <class Test>
+  double  benchClassOp(Test & test, double minTime, int repeatTime=1)
+  {
+    Options opt;
+    opt.cpuTime = true;
+    opt.samples = 10*std::max(repeatTime, 1);
+    opt.sampleTime = minTime/10.0;
+    return benchClassStats(test, opt).median;
+  }
+
+  // Collection of benchmark results written as JSON or CSV together with
+  // a description of the host, and compared against a baseline CSV file:
+  //
+  //   bench::Report report;
+  //   report.run(test, "n=1024");
+  //   report.writeCSV(file);
+  //   return report.compare(baseline, std::cout) ? EXIT_FAILURE : 0;
+  class Report {
+  public:
+
+    struct Result {
+      std::string name;
+      std::string params;
+      Stats stats;
+      std::vector<double> samples;
+    };
+    typedef std::vector<Result>::const_iterator ResultIter;
+
+    Report() {
+      hostInfo();
+    }
 
-#include <cycle.h>
+    void add(const std::string &name, const std::string &params,
+             const Stats &stats,
+             const std::vector<double> &samples=std::vector<double>()) {
+      Result r;
+      r.name = name;
+      r.params = params;
+      r.stats = stats;
+      r.samples = samples;
+      results.push_back(r);
+    }
+    void add(const std::string &name, const std::string &params,
+             const Runner &run) {
+      add(name, params, run.stats(), run.samples());
+    }
+    template <class Test>
+    Stats run(Test & test, const std::string &params="",
+              const Options &opt=Options()) {
+      std::vector<double> samples;
+      Stats stats(benchClassStats(test, opt, &samples));
+      add(test.opName(), params, stats, samples);
+      return stats;
+    }
+    // Extra host or run description, e.g. compile options
+    void setInfo(const std::string &key, const std::string &value) {
+      info[key] = value;
+    }
+    const std::vector<Result> &getResults() const {
+      return results;
+    }
 
+    void writeJSON(std::ostream &os) const {
+      using timeutils::jsonString;
+      os << "{\n  \"host\": {";
+      for (InfoIter i=info.begin(); i!=info.end(); ++i)
+        os << (i==info.begin() ? "\n" : ",\n") << "    "
+           << jsonString(i->first) << ": " << jsonString(i->second);
+      os << "\n  },\n  \"results\": [";
+      std::streamsize p = os.precision(9);
+      for (ResultIter r=results.begin(); r!=results.end(); ++r) {
+        const Stats &x = r->stats;
+        os << (r==results.begin() ? "\n" : ",\n")
+           << "    {\"name\": " << jsonString(r->name)
+           << ", \"params\": " << jsonString(r->params)
+           << ", \"samples\": " << x.samples << ", \"batch\": " << x.batch
+           << ",\n     \"mean\": " << x.mean << ", \"stddev\": " << x.stddev
+           << ", \"min\": " << x.min << ", \"max\": " << x.max
+           << ", \"median\": " << x.median << ", \"mad\": " << x.mad
+           << ",\n     \"p05\": " << x.p05 << ", \"p25\": " << x.p25
+           << ", \"p75\": " << x.p75 << ", \"p95\": " << x.p95
+           << ", \"ci_low\": " << x.ciLow << ", \"ci_high\": " << x.ciHigh
+           << ", \"outliers\": " << x.outliers;
+        for (int e=0; e<perfcounters::Counters::numEvents; ++e) {
+          perfcounters::Counters::eventType t =
+            static_cast<perfcounters::Counters::eventType>(e);
+          if (x.count(t) >= 0.0)
+            os << ", " << jsonString(perfcounters::Counters::name(t)) << ": "
+               << x.count(t);
+        }
+        os << ",\n     \"times\": [";
+        for (size_t i=0; i<r->samples.size(); ++i)
+          os << (i ? ", " : "") << r->samples[i];
+        os << "]}";
+      }
+      os << "\n  ]\n}\n";
+      os.precision(p);
+    }
+
+    // One line per result, the host description as leading # comments
+    void writeCSV(std::ostream &os) const {
+      for (InfoIter i=info.begin(); i!=info.end(); ++i)
+        os << "# " << i->first << ": " << i->second << '\n';
+      os << "name,params,samples,batch,mean,stddev,min,max,median,mad,"
+         << "p05,p25,p75,p95,ci_low,ci_high,outliers";
+      for (int e=0; e<perfcounters::Counters::numEvents; ++e)
+        os << ',' << perfcounters::Counters::name(
+             static_cast<perfcounters::Counters::eventType>(e));
+      os << '\n';
+      std::streamsize p = os.precision(9);
+      for (ResultIter r=results.begin(); r!=results.end(); ++r) {
+        const Stats &x = r->stats;
+        os << csvString(r->name) << ',' << csvString(r->params) << ','
+           << x.samples << ',' << x.batch << ',' << x.mean << ','
+           << x.stddev << ',' << x.min << ',' << x.max << ',' << x.median
+           << ',' << x.mad << ',' << x.p05 << ',' << x.p25 << ',' << x.p75
+           << ',' << x.p95 << ',' << x.ciLow << ',' << x.ciHigh << ','
+           << x.outliers;
+        for (int e=0; e<perfcounters::Counters::numEvents; ++e)
+          os << ',' << x.counts[e];
+        os << '\n';
+      }
+      os.precision(p);
+    }
+
+    // Compare with the results of a CSV file written by writeCSV(). A
+    // result is a regression when its median is more than threshold
+    // slower than the baseline and the confidence intervals of both
+    // medians do not overlap. Returns the number of regressions, -1 if the
+    // baseline cannot be read.
+    int compare(const std::string &baseline, std::ostream &os,
+                double threshold=0.05) const {
+      std::map<std::string, Stats> base;
+      if (!readCSV(baseline, base)) {
+        os << "bench: cannot read baseline " << baseline << std::endl;
+        return -1;
+      }
+      int regressions = 0;
+      for (ResultIter r=results.begin(); r!=results.end(); ++r) {
+        std::map<std::string, Stats>::const_iterator b =
+          base.find(r->name+'\0'+r->params);
+        os << r->name << (r->params.empty() ? "" : " ") << r->params << ": ";
+        if (b == base.end()) {
+          os << "not in baseline" << std::endl;
+          continue;
+        }
+        const Stats &x = r->stats, &y = b->second;
+        double change = (y.median > 0.0 ? x.median/y.median-1.0 : 0.0);
+        os << timeutils::smartTime(y.median) << " -> "
+           << timeutils::smartTime(x.median) << " (";
+        std::ios::fmtflags f = os.flags();
+        std::streamsize p = os.precision(1);
+        os << std::showpos << std::fixed << 100.0*change << " %)";
+        os.flags(f);
+        os.precision(p);
+        if (change > threshold && x.ciLow > y.ciHigh) {
+          os << " REGRESSION";
+          ++regressions;
+        } else if (change < -threshold && x.ciHigh < y.ciLow)
+          os << " improvement";
+        os << std::endl;
+      }
+      return regressions;
+    }
+
+  private:
+
+    typedef std::map<std::string, std::string>::const_iterator InfoIter;
+    std::map<std::string, std::string> info;
+    std::vector<Result> results;
+
+    void hostInfo() {
+      time_t rawtime;
+      time(&rawtime);
+      char date[64];
+      strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&rawtime));
+      info["date"] = date;
+
+      char hostname[MAXHOSTNAMELEN];
+      if (gethostname(hostname, MAXHOSTNAMELEN) == 0)
+        info["hostname"] = hostname;
+
+      std::ifstream cpuinfo("/proc/cpuinfo");
+      std::string line;
+      while (std::getline(cpuinfo, line))
+        if (line.compare(0, 10, "model name") == 0) {
+          std::string::size_type i = line.find(':');
+          if (i != std::string::npos && i+2 <= line.size())
+            info["cpu"] = line.substr(i+2);
+          break;
+        }
+      std::ostringstream n;
+      n << sysconf(_SC_NPROCESSORS_ONLN);
+      info["cpus"] = n.str();
+      info["clock"] = timeutils::Timer::clockName(
+                        timeutils::Timer::defaultClock());
+#if defined(__VERSION__)
+      info["compiler"] = __VERSION__;
+#endif
+    }
+
+    static std::string csvString(const std::string &s) {
+      std::string r("\"");
+      for (size_t i=0; i<s.size(); ++i) {
+        if (s[i] == '"')
+          r += '"';
+        r += s[i];
+      }
+      return r+'"';
+    }
+
+    // Split a CSV line into fields, "" within quotes standing for "
+    static void csvFields(const std::string &line,
+                          std::vector<std::string> &fields) {
+      fields.clear();
+      std::string f;
+      bool quoted = false;
+      for (size_t i=0; i<line.size(); ++i) {
+        char c = line[i];
+        if (quoted) {
+          if (c == '"' && i+1 < line.size() && line[i+1] == '"')
+            f += line[++i];
+          else if (c == '"')
+            quoted = false;
+          else
+            f += c;
+        } else if (c == '"')
+          quoted = true;
+        else if (c == ',') {
+          fields.push_back(f);
+          f.clear();
+        } else
+          f += c;
+      }
+      fields.push_back(f);
+    }
+
+    static bool readCSV(const std::string &file,
+                        std::map<std::string, Stats> &base) {
+      std::ifstream is(file.c_str());
+      if (!is)
+        return false;
+      std::string line;
+      std::vector<std::string> f;
+      bool header = true;
+      while (std::getline(is, line)) {
+        if (line.empty() || line[0] == '#')
+          continue;
+        if (header) {
+          header = false;
+          continue;
+        }
+        csvFields(line, f);
+        if (f.size() < 17)
+          continue;
+        Stats x;
+        std::istringstream v(f[2]+' '+f[3]+' '+f[4]+' '+f[5]+' '+f[6]+' '+
+                             f[7]+' '+f[8]+' '+f[9]+' '+f[10]+' '+f[11]+' '+
+                             f[12]+' '+f[13]+' '+f[14]+' '+f[15]+' '+f[16]);
+        v >> x.samples >> x.batch >> x.mean >> x.stddev >> x.min >> x.max
+          >> x.median >> x.mad >> x.p05 >> x.p25 >> x.p75 >> x.p95
+          >> x.ciLow >> x.ciHigh >> x.outliers;
+        if (v)
+          base[f[0]+'\0'+f[1]] = x;
+      }
+      return true;
+    }
+  };
+
+// Median user time t of one execution of block, see benchClassOp()
 #define BENCH(block,name,mintime,t)                                  \
 {                                                                    \
-	ticks t0, t1;                                                      \
-	double total_t;                                                    \
-	int ni = 1;                                                        \
-	do {                                                               \
-	  t0 = getticks();                                                 \
-		for (int i = 0; i < ni; ++i) {                                   \
+	bench::Options opt_;                                               \
+	opt_.cpuTime = true;                                               \
+	opt_.samples = 10;                                                 \
+	opt_.sampleTime = (mintime)/10.0;                                  \
+	bench::Runner run_(opt_);                                          \
+	while (run_.running()) {                                           \
+		long ni = run_.batch();                                          \
+		run_.start();                                                    \
+		for (long i = 0; i < ni; ++i) {                                  \
 			block                                                          \
+		}                                                                \
+		run_.stop();                                                     \
 	}                                                                  \
-	t1 = getticks();                                                   \
-	t = (total_t=(elapsed(t1,t0))) / ni;                               \
-	ni <<= 1;                                                          \
-	} while (total_t < mintime);                                       \
-	std::cout << "time for one " << name << " = "                      \
-		        << t << std::endl;                                       \
+	t = run_.stats().median;                                           \
+	if (bench::verbose)                                                \
+	  std::cout << "time for one " << name << " = "                    \
+		        << run_.stats() << std::endl;                            \
 }                                                                    \
  
-#endif
-
 }
 
 #endif
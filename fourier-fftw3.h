@@ -39,6 +39,19 @@ namespace fourier {
   const unsigned betterPlanFlag  = FFTW_MEASURE;
   const unsigned optimalPlanFlag = FFTW_PATIENT;
 
+#if defined(HAVE_FFTW3_THREADS)
+  // Number of threads used by the plans created from now on, i.e. at
+  // construction, resize() or setPlanFlag()
+  inline void setPlanThreads(int nthreads) {
+    static bool initialised = false;
+    if (!initialised) {
+      fftw_init_threads();
+      initialised = true;
+    }
+    fftw_plan_with_nthreads(nthreads);
+  }
+#endif
+
   template <>
   class IDFT1D<double, double> : public InPlace<double, double> {
   public:
@@ -68,6 +81,16 @@ namespace fourier {
       fftw_free(inFftw);
     }
 
+    void setPlanFlag(unsigned _flags) {
+      planFlags = _flags;
+      free();
+      create();
+    }
+    // bytes copied to and from the FFTW buffers by direct() and inverse()
+    size_t stagingBytes() const {
+      return 2*blckSize;
+    }
+
   private:
 
     fftw_plan restrict forward;
@@ -119,6 +142,16 @@ namespace fourier {
       fftw_free(inFftw);
     }
 
+    void setPlanFlag(unsigned _flags) {
+      planFlags = _flags;
+      free();
+      create();
+    }
+    // bytes copied to and from the FFTW buffers by direct() and inverse()
+    size_t stagingBytes() const {
+      return 2*blckSize;
+    }
+
   private:
 
     fftw_plan restrict forward;
@@ -178,6 +211,16 @@ namespace fourier {
       fftw_free(inFftw);
     }
 
+    void setPlanFlag(unsigned _flags) {
+      planFlags = _flags;
+      free();
+      create();
+    }
+    // bytes copied to and from the FFTW buffers by direct() and inverse()
+    size_t stagingBytes() const {
+      return 2*blckSize;
+    }
+
   private:
 
     fftw_plan restrict forward;
@@ -231,6 +274,16 @@ namespace fourier {
       fftw_free(outFftw);
     }
 
+    void setPlanFlag(unsigned _flags) {
+      planFlags = _flags;
+      free();
+      create();
+    }
+    // bytes copied to and from the FFTW buffers by direct() and inverse()
+    size_t stagingBytes() const {
+      return 2*blckSize;
+    }
+
   private:
 
     fftw_plan restrict forward;
@@ -285,6 +338,16 @@ namespace fourier {
       fftw_free(outFftw);
     }
 
+    void setPlanFlag(unsigned _flags) {
+      planFlags = _flags;
+      free();
+      create();
+    }
+    // bytes copied to and from the FFTW buffers by direct() and inverse()
+    size_t stagingBytes() const {
+      return 2*blckSize;
+    }
+
   private:
 
     fftw_plan restrict forward;
@@ -349,6 +412,10 @@ namespace fourier {
       free();
       create();
     }
+    // bytes copied to and from the FFTW buffers by direct() and inverse()
+    size_t stagingBytes() const {
+      return 2*blckSize;
+    }
 
   private:
 
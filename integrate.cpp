@@ -29,19 +29,26 @@
 
 #include <integrate.h>
 
-#define INTEGRATE_IMPL(type,dim)                                           \
-type integrate(blitz::Array<type,dim> &F,                                  \
-               blitz::TinyVector<type,dim> &dr, type &dI)                  \
-{                                                                          \
-	return integrate_t<type>(F, dr, dI);                                     \
-}                                                                          \
- 
-
-INTEGRATE_IMPL(float,1)
-INTEGRATE_IMPL(float,2)
-INTEGRATE_IMPL(float,3)
-
-INTEGRATE_IMPL(double,1)
-INTEGRATE_IMPL(double,2)
-INTEGRATE_IMPL(double,3)
+// Convenience instantiations of the most common cases, other element types
+// and ranks are instantiated from the templates in integrate.h
+
+#define INTEGRATE_IMPL(type,accum,dim)                                     \
+template accum integrate(const blitz::Array<type,dim> &F,                  \
+                         const blitz::TinyVector<accum,dim> &dr,           \
+                         accum &dI);                                       \
+template accum integrate(const blitz::Array<type,dim> &F,                  \
+                         const blitz::TinyVector<accum,dim> &dr);
+
+INTEGRATE_IMPL(float,float,1)
+INTEGRATE_IMPL(float,float,2)
+INTEGRATE_IMPL(float,float,3)
+
+// float fields accumulated in double
+INTEGRATE_IMPL(float,double,1)
+INTEGRATE_IMPL(float,double,2)
+INTEGRATE_IMPL(float,double,3)
+
+INTEGRATE_IMPL(double,double,1)
+INTEGRATE_IMPL(double,double,2)
+INTEGRATE_IMPL(double,double,3)
 
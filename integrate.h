@@ -31,56 +31,101 @@
 #define INTEGRATE_H
 
 #include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
 #include <blitz/array.h>
 
-#define INTEGRATE_DECL(type,dim,statvar)                                   \
-type integrate(blitz::Array<type,dim> &F, blitz::TinyVector<type,dim> &dr, \
-               type &dI=statvar);
+namespace quadrature {
 
-static float int_ferror;
-INTEGRATE_DECL(float,1,int_ferror)
-INTEGRATE_DECL(float,2,int_ferror)
-INTEGRATE_DECL(float,3,int_ferror)
+  // Compensated (Kahan) summation. The correction term is lost if the code
+  // is compiled with value-unsafe optimisations such as -ffast-math.
+  template<typename T_accum>
+  class KahanSum {
+  public:
+    explicit KahanSum(T_accum s=0.0) : sum(s), c(0.0) {}
+    KahanSum &operator+=(T_accum x) {
+      T_accum y = x-c;
+      T_accum t = sum+y;
+      c = (t-sum)-y;
+      sum = t;
+      return *this;
+    }
+    KahanSum &operator-=(T_accum x) {
+      return *this += -x;
+    }
+    operator T_accum() const {
+      return sum;
+    }
+  private:
+    T_accum sum;
+    T_accum c;
+  };
 
-static double int_derror;
-INTEGRATE_DECL(double,1,int_derror)
-INTEGRATE_DECL(double,2,int_derror)
-INTEGRATE_DECL(double,3,int_derror)
+  // Pairwise summation of n elements x[i*stride] in precision T_accum,
+  // the rounding error growing as O(log n) instead of O(n).
+  template<typename T_accum, typename T_numtype>
+  T_accum pairwiseSum(const T_numtype *x, long n, long stride)
+  {
+    if (n <= 16) {
+      T_accum s = 0.0;
+      for (long i=0; i<n; ++i)
+        s += x[i*stride];
+      return s;
+    }
+    long m = n/2;
+    return pairwiseSum<T_accum>(x, m, stride) +
+           pairwiseSum<T_accum>(x+m*stride, n-m, stride);
+  }
 
-template<typename T_numtype>
-void d01gaf(blitz::Array<T_numtype,1> &y, T_numtype &dx, T_numtype &I,
-            T_numtype &dI)
+  // Pairwise sum of the elements of an array with contiguous storage
+  template<typename T_accum, typename T_numtype, int N_rank>
+  T_accum pairwiseSum(const blitz::Array<T_numtype,N_rank> &A)
+  {
+    long stride = A.stride(A.ordering(0));
+    return pairwiseSum<T_accum>(A.data(), A.numElements(), stride);
+  }
+
+}
+
+// Gill-Miller four-point cubic fit integration of the n points y[0],
+// y[stride], ..., y[(n-1)*stride] with uniform spacing dx. The samples are
+// converted to and the integral accumulated (with compensated summation)
+// in the precision T_accum of dx, I and dI.
+template<typename T_numtype, typename T_accum>
+void d01gaf(const T_numtype *y, int n, long stride, T_accum dx,
+            T_accum &I, T_accum &dI)
 {
   using blitz::pow2;
   using blitz::pow5;
   using std::cerr;
   using std::endl;
 
-  const int n = y.rows();
-
   if (n < 4) {
     cerr << "d01gaf: array must contain at least 4 points." << endl;
     throw(EXIT_FAILURE);
   }
 
+#define Y(i) static_cast<T_accum>(y[(i)*stride])
   // Integrate over initial interval
-  T_numtype d3 = (y(1)-y(0))/dx;
-  T_numtype d1 = (y(2)-y(1))/dx;
-  T_numtype d2 = (d1-d3)/(2.0*dx);
-  T_numtype r1 = (y(3)-y(2))/dx;
-  T_numtype r2 = (r1-d1)/(2.0*dx);
-  T_numtype r3 = (r2-d2)/(3.0*dx);
+  T_accum d3 = (Y(1)-Y(0))/dx;
+  T_accum d1 = (Y(2)-Y(1))/dx;
+  T_accum d2 = (d1-d3)/(2.0*dx);
+  T_accum r1 = (Y(3)-Y(2))/dx;
+  T_accum r2 = (r1-d1)/(2.0*dx);
+  T_accum r3 = (r2-d2)/(3.0*dx);
 
-  I = dx*(y(0)+dx*(d3*0.5-dx*(d2/6.0-dx*r3/4.0)));
-  T_numtype s = -19.0/30.0*pow5(dx);
-  T_numtype r4 = 0.0;
+  quadrature::KahanSum<T_accum>
+  sI(dx*(Y(0)+dx*(d3*0.5-dx*(d2/6.0-dx*r3/4.0)))), sdI;
+  T_accum s = -19.0/30.0*pow5(dx);
+  T_accum r4 = 0.0;
 
   // Integrate over central portion of range
-  dI = 0.0;
   for (int i=2; i<n-1; ++i) {
-    I += dx*((y(i)+y(i-1))*0.5-pow2(dx)*(d2+r2)/12.0);
-    T_numtype c = 11.0/60.0*pow5(dx);
-    dI += (c+s)*r4;
+    sI += dx*((Y(i)+Y(i-1))*0.5-pow2(dx)*(d2+r2)/12.0);
+    T_accum c = 11.0/60.0*pow5(dx);
+    sdI += (c+s)*r4;
     if ( i != 2 )
       s = c;
     else
@@ -89,61 +134,723 @@ void d01gaf(blitz::Array<T_numtype,1> &y, T_numtype &dx, T_numtype &I,
       d1 = r1;
       d2 = r2;
       d3 = r3;
-      r1 = (y(i+2)-y(i+1))/dx;
+      r1 = (Y(i+2)-Y(i+1))/dx;
       r2 = (r1-d1)/(2.0*dx);
       r3 = (r2-d2)/(3.0*dx);
       r4 = (r3-d3)/(4.0*dx);
     } else
       break;
   }
-  I += dx*(y(n-1)-dx*(r1*0.5+dx*(r2/6.0+dx*r3/4.0)));
-  dI -= 19.0/30.0*pow5(dx)*r4+s*r4;
-  I += dI;
+  sI += dx*(Y(n-1)-dx*(r1*0.5+dx*(r2/6.0+dx*r3/4.0)));
+  sdI -= 19.0/30.0*pow5(dx)*r4+s*r4;
+  dI = sdI;
+  I = sI+dI;
+#undef Y
 }
 
 template<typename T_numtype>
-T_numtype integrate_t(blitz::Array<T_numtype,1> &y,
-                      blitz::TinyVector<T_numtype,1> &dr, T_numtype &dI)
+void d01gaf(blitz::Array<T_numtype,1> &y, T_numtype &dx, T_numtype &I,
+            T_numtype &dI)
 {
-  T_numtype I;
-  d01gaf(y, dr(0), I, dI);
-  return I;
+  d01gaf(y.data(), y.rows(), y.stride(0), dx, I, dI);
 }
 
-template<typename T_numtype>
-T_numtype integrate_t(blitz::Array<T_numtype,2> &F,
-                      blitz::TinyVector<T_numtype,2> &dr, T_numtype &dI)
+// Running integral of the same scheme: C[i*cstride] is the integral from
+// y[0] to y[i*stride], the last point being identical to d01gaf().
+template<typename T_numtype, typename T_accum>
+void d01gafCumulative(const T_numtype *y, int n, long stride, T_accum dx,
+                      T_accum *C, long cstride)
 {
-  const int ny = F.cols();
-  blitz::Array<T_numtype,1> Iy(ny), dIy(ny);
-  blitz::TinyVector<T_numtype,1> dx(dr(0));
-  for (int j=0; j<ny; ++j) {
-    blitz::Array<T_numtype,1> Fx ( F(blitz::Range::all(), j) );
-    Iy(j) = integrate_t<T_numtype>(Fx, dx, dIy(j));
+  using blitz::pow2;
+  using blitz::pow5;
+  using std::cerr;
+  using std::endl;
+
+  if (n < 4) {
+    cerr << "d01gafCumulative: array must contain at least 4 points." << endl;
+    throw(EXIT_FAILURE);
+  }
+
+#define Y(i) static_cast<T_accum>(y[(i)*stride])
+  T_accum d3 = (Y(1)-Y(0))/dx;
+  T_accum d1 = (Y(2)-Y(1))/dx;
+  T_accum d2 = (d1-d3)/(2.0*dx);
+  T_accum r1 = (Y(3)-Y(2))/dx;
+  T_accum r2 = (r1-d1)/(2.0*dx);
+  T_accum r3 = (r2-d2)/(3.0*dx);
+
+  quadrature::KahanSum<T_accum>
+  sI(dx*(Y(0)+dx*(d3*0.5-dx*(d2/6.0-dx*r3/4.0)))), sdI;
+  T_accum s = -19.0/30.0*pow5(dx);
+  T_accum r4 = 0.0;
+  C[0] = 0.0;
+  C[cstride] = sI;
+
+  for (int i=2; i<n-1; ++i) {
+    sI += dx*((Y(i)+Y(i-1))*0.5-pow2(dx)*(d2+r2)/12.0);
+    T_accum c = 11.0/60.0*pow5(dx);
+    sdI += (c+s)*r4;
+    C[i*cstride] = T_accum(sI)+T_accum(sdI);
+    if ( i != 2 )
+      s = c;
+    else
+      s += 2.0*c;
+    if ( i != n-2 ) {
+      d1 = r1;
+      d2 = r2;
+      d3 = r3;
+      r1 = (Y(i+2)-Y(i+1))/dx;
+      r2 = (r1-d1)/(2.0*dx);
+      r3 = (r2-d2)/(3.0*dx);
+      r4 = (r3-d3)/(4.0*dx);
+    } else
+      break;
   }
-  blitz::TinyVector<T_numtype,1> dy(dr(1));
-  T_numtype I = integrate_t<T_numtype>(Iy, dy, dI);
-  dI += blitz::sum(dIy);
-  return I;
+  sI += dx*(Y(n-1)-dx*(r1*0.5+dx*(r2/6.0+dx*r3/4.0)));
+  sdI -= 19.0/30.0*pow5(dx)*r4+s*r4;
+  C[(n-1)*cstride] = T_accum(sI)+T_accum(sdI);
+#undef Y
 }
 
-template<typename T_numtype>
-T_numtype integrate_t(blitz::Array<T_numtype,3> &F,
-                      blitz::TinyVector<T_numtype,3> &dr, T_numtype &dI)
+// Gill-Miller four-point cubic fit integration of the tabulated points
+// (x[i*xstride], y[i*stride]) with arbitrary, strictly increasing abscissae.
+// The error estimate generalises the uniform one using the local interval
+// widths. If C is not null the running integral is stored into it as well.
+template<typename T_numtype, typename T_accum>
+void d01gafGrid(const T_accum *x, long xstride, const T_numtype *y, int n,
+                long stride, T_accum &I, T_accum &dI,
+                T_accum *C=0, long cstride=0)
+{
+  using blitz::pow2;
+  using blitz::pow5;
+  using std::cerr;
+  using std::endl;
+
+  if (n < 4) {
+    cerr << "d01gafGrid: array must contain at least 4 points." << endl;
+    throw(EXIT_FAILURE);
+  }
+
+#define X(i) x[(i)*xstride]
+#define Y(i) static_cast<T_accum>(y[(i)*stride])
+  // Integrate over initial interval
+  T_accum h1 = X(1)-X(0);
+  T_accum h2 = X(2)-X(1);
+  T_accum d3 = (Y(1)-Y(0))/h1;
+  T_accum d1 = (Y(2)-Y(1))/h2;
+  T_accum d2 = (d1-d3)/(X(2)-X(0));
+  T_accum r1 = (Y(3)-Y(2))/(X(3)-X(2));
+  T_accum r2 = (r1-d1)/(X(3)-X(1));
+  T_accum r3 = (r2-d2)/(X(3)-X(0));
+
+  quadrature::KahanSum<T_accum>
+  sI(h1*(Y(0)+h1*(d3*0.5-h1*(d2/6.0-(h1+2.0*h2)*r3/12.0)))), sdI;
+  T_accum s = -19.0/30.0*pow5(h1);
+  T_accum r4 = 0.0;
+  if (C) {
+    C[0] = 0.0;
+    C[cstride] = sI;
+  }
+
+  // Integrate over central portion of range
+  for (int i=2; i<n-1; ++i) {
+    T_accum h = X(i)-X(i-1);
+    T_accum hl = X(i-1)-X(i-2);
+    T_accum hr = X(i+1)-X(i);
+    sI += h*((Y(i)+Y(i-1))*0.5-pow2(h)*(d2+r2+(hl-hr)*r3)/12.0);
+    T_accum c = 11.0/60.0*pow5(h);
+    sdI += (c+s)*r4;
+    if (C)
+      C[i*cstride] = T_accum(sI)+T_accum(sdI);
+    if ( i != 2 )
+      s = c;
+    else
+      s += 2.0*c;
+    if ( i != n-2 ) {
+      d1 = r1;
+      d2 = r2;
+      d3 = r3;
+      r1 = (Y(i+2)-Y(i+1))/(X(i+2)-X(i+1));
+      r2 = (r1-d1)/(X(i+2)-X(i));
+      r3 = (r2-d2)/(X(i+2)-X(i-1));
+      r4 = (r3-d3)/(X(i+2)-X(i-2));
+    } else
+      break;
+  }
+  T_accum h = X(n-1)-X(n-2);
+  T_accum hp = X(n-2)-X(n-3);
+  sI += h*(Y(n-1)-h*(r1*0.5+h*(r2/6.0+(h+2.0*hp)*r3/12.0)));
+  sdI -= 19.0/30.0*pow5(h)*r4+s*r4;
+  dI = sdI;
+  I = sI+dI;
+  if (C)
+    C[(n-1)*cstride] = I;
+#undef X
+#undef Y
+}
+
+namespace quadrature {
+
+  // Uniform spacing rule applied to the lines of a multi-dimensional array.
+  // The rules are parameterised by the accumulation type T_accum, the lines
+  // may be of any element type convertible to it.
+  template<typename T_accum>
+  class GillMiller {
+  public:
+    explicit GillMiller(T_accum _dx) : dx(_dx) {}
+    // number of points required per line, 0 if any
+    int points() const {
+      return 0;
+    }
+    template<typename T_numtype>
+    void operator()(const T_numtype *y, int n, long stride,
+                    T_accum &I, T_accum &dI) const {
+      d01gaf(y, n, stride, dx, I, dI);
+    }
+    template<typename T_numtype>
+    void cumulative(const T_numtype *y, int n, long stride,
+                    T_accum *C, long cstride) const {
+      d01gafCumulative(y, n, stride, dx, C, cstride);
+    }
+  private:
+    T_accum dx;
+  };
+
+  // Gill-Miller rule on the abscissae x of a non-uniform grid
+  template<typename T_accum>
+  class GillMillerGrid {
+  public:
+    explicit GillMillerGrid(const blitz::Array<T_accum,1> &_x) : x(_x) {}
+    int points() const {
+      return x.rows();
+    }
+    template<typename T_numtype>
+    void operator()(const T_numtype *y, int n, long stride,
+                    T_accum &I, T_accum &dI) const {
+      d01gafGrid(x.data(), x.stride(0), y, n, stride, I, dI);
+    }
+    template<typename T_numtype>
+    void cumulative(const T_numtype *y, int n, long stride,
+                    T_accum *C, long cstride) const {
+      T_accum I, dI;
+      d01gafGrid(x.data(), x.stride(0), y, n, stride, I, dI, C, cstride);
+    }
+  private:
+    blitz::Array<T_accum,1> x;
+  };
+
+  // Base of the rules that are a fixed linear combination of the samples on
+  // a given grid. The weights w are computed once and shared by all lines;
+  // e are the weights of the difference with an embedded lower order rule
+  // and give the error estimate.
+  template<typename T_accum>
+  class WeightedRule {
+  public:
+    int points() const {
+      return w.rows();
+    }
+    template<typename T_numtype>
+    void operator()(const T_numtype *y, int n, long stride,
+                    T_accum &I, T_accum &dI) const {
+      const T_accum *pw = w.data(), *pe = e.data();
+      KahanSum<T_accum> s, ds;
+      for (int i=0; i<n; ++i) {
+        T_accum yi = y[i*stride];
+        s += pw[i]*yi;
+        ds += pe[i]*yi;
+      }
+      I = s;
+      dI = ds;
+    }
+    const blitz::Array<T_accum,1> &weights() const {
+      return w;
+    }
+  protected:
+    explicit WeightedRule(int n) : w(n), e(n) {
+      w = 0.0;
+      e = 0.0;
+    }
+    blitz::Array<T_accum,1> w;
+    blitz::Array<T_accum,1> e;
+
+    // trapezoid weights on x, used as embedded rule
+    static void trapezoid(const blitz::Array<T_accum,1> &x,
+                          blitz::Array<T_accum,1> &t) {
+      const int n = x.rows();
+      t = 0.0;
+      for (int i=1; i<n; ++i) {
+        double h = x(i)-x(i-1);
+        t(i-1) += 0.5*h;
+        t(i) += 0.5*h;
+      }
+    }
+  };
+
+  // Composite Simpson rule on a non-uniform grid. With an odd number of
+  // intervals the last one is integrated with the parabola through the
+  // last three points. The error estimate is the difference with the
+  // trapezoidal rule, a pessimistic bound for smooth data.
+  template<typename T_accum>
+  class Simpson : public WeightedRule<T_accum> {
+  public:
+    explicit Simpson(const blitz::Array<T_accum,1> &x) :
+      WeightedRule<T_accum>(x.rows()) {
+      using std::cerr;
+      using std::endl;
+      const int n = x.rows();
+      if (n < 3) {
+        cerr << "Simpson: array must contain at least 3 points." << endl;
+        throw(EXIT_FAILURE);
+      }
+      blitz::Array<T_accum,1> &w = this->w;
+      int i;
+      for (i=0; i+2<n; i+=2) {
+        double h0 = x(i+1)-x(i);
+        double h1 = x(i+2)-x(i+1);
+        double hs = (h0+h1)/6.0;
+        w(i)   += hs*(2.0-h1/h0);
+        w(i+1) += hs*(h0+h1)*(h0+h1)/(h0*h1);
+        w(i+2) += hs*(2.0-h0/h1);
+      }
+      if (i == n-2) {
+        double h0 = x(n-2)-x(n-3);
+        double h1 = x(n-1)-x(n-2);
+        w(n-1) += (2.0*h1*h1+3.0*h0*h1)/(6.0*(h0+h1));
+        w(n-2) += (h1*h1+3.0*h0*h1)/(6.0*h0);
+        w(n-3) -= h1*h1*h1/(6.0*h0*(h0+h1));
+      }
+      this->trapezoid(x, this->e);
+      this->e = w-this->e;
+    }
+  };
+
+  // Gauss-Legendre quadrature of the piecewise interpolating polynomial of
+  // the tabulated data: panels of degree+1 consecutive points are
+  // interpolated by a polynomial of that degree which is integrated exactly
+  // with (degree+2)/2 Gauss-Legendre nodes. The error estimate is the
+  // difference with the same construction at degree-1.
+  template<typename T_accum>
+  class GaussLegendre : public WeightedRule<T_accum> {
+  public:
+    explicit GaussLegendre(const blitz::Array<T_accum,1> &x, int degree=3) :
+      WeightedRule<T_accum>(x.rows()) {
+      using std::cerr;
+      using std::endl;
+      if (degree < 1 || x.rows() < degree+1) {
+        cerr << "GaussLegendre: degree must be at least 1 and array must "
+             << "contain at least degree+1 points." << endl;
+        throw(EXIT_FAILURE);
+      }
+      panelWeights(x, degree, this->w);
+      panelWeights(x, degree-1, this->e);
+      this->e = this->w-this->e;
+    }
+
+  private:
+
+    // Nodes t and weights g of the q-point rule on [-1,1]
+    static void nodes(int q, std::vector<double> &t, std::vector<double> &g) {
+      t.resize(q);
+      g.resize(q);
+      for (int k=0; k<q; ++k) {
+        double z = std::cos(M_PI*(k+0.75)/(q+0.5));
+        double dp = 0.0, dz;
+        do {
+          double p0 = 1.0, p1 = 0.0;
+          for (int j=1; j<=q; ++j) {
+            double p2 = p1;
+            p1 = p0;
+            p0 = ((2.0*j-1.0)*z*p1-(j-1.0)*p2)/j;
+          }
+          dp = q*(z*p0-p1)/(z*z-1.0);
+          dz = p0/dp;
+          z -= dz;
+        } while (std::fabs(dz) > 1.0e-15);
+        t[k] = z;
+        g[k] = 2.0/((1.0-z*z)*dp*dp);
+      }
+    }
+
+    static void panelWeights(const blitz::Array<T_accum,1> &x, int degree,
+                             blitz::Array<T_accum,1> &w) {
+      const int n = x.rows();
+      w = 0.0;
+      if (degree == 0) {
+        WeightedRule<T_accum>::trapezoid(x, w);
+        return;
+      }
+      std::vector<double> t, g;
+      nodes((degree+2)/2, t, g);
+      for (int j=0; j<n-1; j+=degree) {
+        // last panel reuses the last degree+1 points
+        int p = std::min(j, n-1-degree);
+        double a = x(j), b = x(std::min(j+degree, n-1));
+        for (size_t k=0; k<t.size(); ++k) {
+          double xk = 0.5*(a+b)+0.5*(b-a)*t[k];
+          for (int m=0; m<=degree; ++m) {
+            double L = 1.0;
+            for (int l=0; l<=degree; ++l)
+              if (l != m)
+                L *= (xk-x(p+l))/(x(p+m)-x(p+l));
+            w(p+m) += 0.5*(b-a)*g[k]*L;
+          }
+        }
+      }
+    }
+  };
+
+  // Integral of the 1-d array y with one of the rules above
+  template<typename T_numtype, typename T_accum, typename T_rule>
+  T_accum integrate(const blitz::Array<T_numtype,1> &y, const T_rule &rule,
+                    T_accum &dI)
+  {
+    using std::cerr;
+    using std::endl;
+    if (rule.points() != 0 && rule.points() != y.rows()) {
+      cerr << "integrate: rule defined for " << rule.points()
+           << " points, array has " << y.rows() << "." << endl;
+      throw(EXIT_FAILURE);
+    }
+    T_accum I;
+    rule(y.data(), y.rows(), y.stride(0), I, dI);
+    return I;
+  }
+
+  // Layout of the lines running along one axis of an N-d array. Lines are
+  // numbered with the remaining dimensions enumerated fastest-varying first
+  // so that consecutive lines are neighbours in memory and a sweep over all
+  // lines streams through the array in storage order. With step > 1 only
+  // every step-th point in every dimension is visited.
+  template<int N_rank>
+  class LineLayout {
+  public:
+    template<typename T_numtype>
+    LineLayout(const blitz::Array<T_numtype,N_rank> &F, int _axis,
+               int step=1) :
+      axis(_axis), n((F.extent(_axis)-1)/step+1),
+      stride(step*F.stride(_axis)), nlines(1) {
+      for (int r=0, k=0; r<N_rank; ++r) {
+        int d = F.ordering(r);
+        if (d == axis)
+          continue;
+        dims[k] = d;
+        ext[k] = (F.extent(d)-1)/step+1;
+        str[k] = step*F.stride(d);
+        nlines *= ext[k++];
+      }
+    }
+    int length() const {
+      return n;
+    }
+    long lineStride() const {
+      return stride;
+    }
+    int lines() const {
+      return nlines;
+    }
+    // Strides of an output array in line order. The output either drops the
+    // integration axis (rank N-1) or keeps it (rank N).
+    template<typename T_numtype, int N_out>
+    void strides(const blitz::Array<T_numtype,N_out> &O, long *ostr) const {
+      for (int k=0; k<N_rank-1; ++k) {
+        int d = dims[k];
+        if (N_out < N_rank && d > axis)
+          --d;
+        ostr[k] = O.stride(d);
+      }
+    }
+    template<typename T_numtype, int N_out>
+    bool conforms(const blitz::Array<T_numtype,N_out> &O) const {
+      for (int k=0; k<N_rank-1; ++k) {
+        int d = dims[k];
+        if (N_out < N_rank && d > axis)
+          --d;
+        if (O.extent(d) != ext[k])
+          return false;
+      }
+      return N_out < N_rank || O.extent(axis) == n;
+    }
+    long offset(int line) const {
+      return offset(line, str);
+    }
+    long offset(int line, const long *s) const {
+      long off = 0;
+      for (int k=0; k<N_rank-1; ++k) {
+        off += (line % ext[k])*s[k];
+        line /= ext[k];
+      }
+      return off;
+    }
+  private:
+    int axis;
+    int n;
+    long stride;
+    int nlines;
+    int dims[N_rank];
+    int ext[N_rank];
+    long str[N_rank];
+  };
+
+  template<typename T_rule, int N_rank>
+  void checkLines(const char *name, const T_rule &rule,
+                  const LineLayout<N_rank> &L, bool conform)
+  {
+    using std::cerr;
+    using std::endl;
+    if (!conform) {
+      cerr << name << ": output array does not conform to input." << endl;
+      throw(EXIT_FAILURE);
+    }
+    if (rule.points() != 0 && rule.points() != L.length()) {
+      cerr << name << ": rule defined for " << rule.points()
+           << " points, line has " << L.length() << "." << endl;
+      throw(EXIT_FAILURE);
+    }
+  }
+
+  // Integrate every line of F along axis into the preallocated arrays I and
+  // dI of rank N-1, optionally sampling every step-th point only.
+  template<typename T_numtype, typename T_accum, int N_rank, typename T_rule>
+  void integrateLines(const blitz::Array<T_numtype,N_rank> &F, int axis,
+                      const T_rule &rule,
+                      blitz::Array<T_accum,N_rank-1> &I,
+                      blitz::Array<T_accum,N_rank-1> &dI, int step=1)
+  {
+    const LineLayout<N_rank> L(F, axis, step);
+    checkLines("integrateLines", rule, L, L.conforms(I) && L.conforms(dI));
+    long Is[N_rank], dIs[N_rank];
+    L.strides(I, Is);
+    L.strides(dI, dIs);
+    const T_numtype *y = F.data();
+    T_accum *pI = I.data(), *pdI = dI.data();
+    const int n = L.length(), nlines = L.lines();
+    const long stride = L.lineStride();
+#if defined(_OPENMP)
+    #pragma omp parallel for schedule(static)
+#endif
+    for (int l=0; l<nlines; ++l)
+      rule(y+L.offset(l), n, stride, pI[L.offset(l, Is)], pdI[L.offset(l, dIs)]);
+  }
+
+  // Running integral of every line of F along axis into the preallocated
+  // array C of the same shape as F.
+  template<typename T_numtype, typename T_accum, int N_rank, typename T_rule>
+  void cumulateLines(const blitz::Array<T_numtype,N_rank> &F, int axis,
+                     const T_rule &rule, blitz::Array<T_accum,N_rank> &C)
+  {
+    const LineLayout<N_rank> L(F, axis);
+    checkLines("cumulateLines", rule, L, L.conforms(C));
+    long Cs[N_rank];
+    L.strides(C, Cs);
+    const T_numtype *y = F.data();
+    T_accum *pC = C.data();
+    const int n = L.length(), nlines = L.lines();
+    const long stride = L.lineStride(), cstride = C.stride(axis);
+#if defined(_OPENMP)
+    #pragma omp parallel for schedule(static)
+#endif
+    for (int l=0; l<nlines; ++l)
+      rule.cumulative(y+L.offset(l), n, stride, pC+L.offset(l, Cs), cstride);
+  }
+
+}
+
+// Integral of F along axis with uniform spacing dx, e.g. column densities of
+// a 3-d field. I and dI have the shape of F without axis and may be of a
+// wider type than F, e.g. double for a float field.
+template<typename T_numtype, typename T_accum, int N_rank>
+void integrateAlong(const blitz::Array<T_numtype,N_rank> &F, int axis,
+                    T_accum dx, blitz::Array<T_accum,N_rank-1> &I,
+                    blitz::Array<T_accum,N_rank-1> &dI)
 {
-  const int nz = F.depth();
-  blitz::Array<T_numtype,1> Iz(nz), dIz(nz);
-  blitz::TinyVector<T_numtype,2> dxdy(dr(0), dr(1));
-  for (int k=0; k<nz; ++k) {
-    blitz::Array<T_numtype,2> Fxy ( F(blitz::Range::all(),
-                                      blitz::Range::all(), k) );
-    Iz(k) = integrate_t<T_numtype>(Fxy, dxdy, dIz(k));
+  quadrature::integrateLines(F, axis, quadrature::GillMiller<T_accum>(dx),
+                             I, dI);
+}
+
+// Running integral of F along axis with uniform spacing dx into C, an array
+// of the same shape as F.
+template<typename T_numtype, typename T_accum, int N_rank>
+void integrateCumulative(const blitz::Array<T_numtype,N_rank> &F, int axis,
+                         T_accum dx, blitz::Array<T_accum,N_rank> &C)
+{
+  quadrature::cumulateLines(F, axis, quadrature::GillMiller<T_accum>(dx), C);
+}
+
+namespace quadrature {
+
+  // Rule of a dimension given either as a uniform spacing or a rule object
+  template<typename T_accum, typename T_rule,
+           bool uniform=std::is_arithmetic<T_rule>::value>
+  struct RuleOf {
+    typedef T_rule type;
+    static const T_rule &make(const T_rule &rule) {
+      return rule;
+    }
+  };
+
+  template<typename T_accum, typename T_rule>
+  struct RuleOf<T_accum, T_rule, true> {
+    typedef GillMiller<T_accum> type;
+    static GillMiller<T_accum> make(T_rule dx) {
+      return GillMiller<T_accum>(dx);
+    }
+  };
+
+  // Compile-time recursion over the dimensions: the first dimension is
+  // integrated into an array of rank N-1 which is integrated in turn, the
+  // error estimates of all levels being summed up. The intermediate arrays
+  // are of the accumulation type T_accum whatever the type of F.
+  template<int N_rank>
+  struct Reduce {
+    template<typename T_numtype, typename T_accum, typename T_rule,
+             typename... T_rules>
+    static T_accum apply(const blitz::Array<T_numtype,N_rank> &F,
+                         T_accum &dI, const T_rule &rule,
+                         const T_rules&... rules) {
+      blitz::TinyVector<int,N_rank-1> shape;
+      for (int d=1; d<N_rank; ++d)
+        shape(d-1) = F.extent(d);
+      blitz::Array<T_accum,N_rank-1> Ix(shape), dIx(shape);
+      integrateLines(F, 0, RuleOf<T_accum,T_rule>::make(rule), Ix, dIx);
+      T_accum I = Reduce<N_rank-1>::apply(Ix, dI, rules...);
+      dI += pairwiseSum<T_accum>(dIx);
+      return I;
+    }
+    // Uniform spacings dr scaled by h, sampling every step-th point
+    template<typename T_numtype, typename T_accum>
+    static T_accum uniform(const blitz::Array<T_numtype,N_rank> &F,
+                           const T_accum *dr, T_accum &dI,
+                           int step=1, int h=1) {
+      blitz::TinyVector<int,N_rank-1> shape;
+      for (int d=1; d<N_rank; ++d)
+        shape(d-1) = (F.extent(d)-1)/step+1;
+      blitz::Array<T_accum,N_rank-1> Ix(shape), dIx(shape);
+      integrateLines(F, 0, GillMiller<T_accum>(h*dr[0]), Ix, dIx, step);
+      T_accum I = Reduce<N_rank-1>::uniform(Ix, dr+1, dI, 1, h);
+      dI += pairwiseSum<T_accum>(dIx);
+      return I;
+    }
+  };
+
+  template<>
+  struct Reduce<1> {
+    template<typename T_numtype, typename T_accum, typename T_rule>
+    static T_accum apply(const blitz::Array<T_numtype,1> &F,
+                         T_accum &dI, const T_rule &rule) {
+      return integrate(F, RuleOf<T_accum,T_rule>::make(rule), dI);
+    }
+    template<typename T_numtype, typename T_accum>
+    static T_accum uniform(const blitz::Array<T_numtype,1> &F,
+                           const T_accum *dr, T_accum &dI,
+                           int step=1, int h=1) {
+      T_accum I;
+      d01gaf(F.data(), (F.rows()-1)/step+1, step*F.stride(0), h*dr[0],
+             I, dI);
+      return I;
+    }
+  };
+
+}
+
+// Integral of the N-d array F with uniform spacings dr, dI being set to the
+// error estimate. The sums are carried out with compensated summation in the
+// type of dr, so that a float field can be integrated to double accuracy
+// without a converted copy by passing double spacings.
+template<typename T_numtype, typename T_accum, int N_rank>
+T_accum integrate(const blitz::Array<T_numtype,N_rank> &F,
+                  const blitz::TinyVector<T_accum,N_rank> &dr,
+                  T_accum &dI)
+{
+  return quadrature::Reduce<N_rank>::uniform(F, dr.data(), dI);
+}
+
+template<typename T_numtype, typename T_accum, int N_rank>
+T_accum integrate(const blitz::Array<T_numtype,N_rank> &F,
+                  const blitz::TinyVector<T_accum,N_rank> &dr)
+{
+  T_accum dI;
+  return quadrature::Reduce<N_rank>::uniform(F, dr.data(), dI);
+}
+
+// Integral of the N-d array F given one spacing or quadrature rule per
+// dimension, e.g. integrate(F, dI, dx, quadrature::Simpson<double>(y), dz).
+// The accumulation type is the type of dI.
+template<typename T_numtype, typename T_accum, int N_rank,
+         typename... T_rules>
+typename std::enable_if<std::is_floating_point<T_accum>::value, T_accum>::type
+integrate(const blitz::Array<T_numtype,N_rank> &F, T_accum &dI,
+          const T_rules&... rules)
+{
+  static_assert(sizeof...(T_rules) == N_rank,
+                "integrate: one spacing or rule per dimension required");
+  return quadrature::Reduce<N_rank>::apply(F, dI, rules...);
+}
+
+// Integral of F with uniform spacings dr to the absolute tolerance tol.
+// Sampling every 8th, 4th and 2nd point in all dimensions is tried first
+// when the extents allow it: a coarse level is accepted when both its own
+// error estimate and the Richardson estimate |I(h)-I(2h)|/15 of the fourth
+// order scheme against the previous level are within tol, the returned
+// value being extrapolated. dI is set to the achieved error estimate and
+// stride to the sampling used.
+template<typename T_numtype, typename T_accum, int N_rank>
+T_accum integrateAdaptive(const blitz::Array<T_numtype,N_rank> &F,
+                          const blitz::TinyVector<T_accum,N_rank> &dr,
+                          T_accum tol, T_accum &dI, int &stride)
+{
+  using std::abs;
+  using quadrature::Reduce;
+
+  T_accum Ic = 0.0;
+  bool coarser = false;
+  // down to all the points, stride 1, which always returns
+  for (stride=8; ; stride/=2) {
+    bool sampled = true;
+    for (int d=0; d<N_rank; ++d)
+      if ((F.extent(d)-1) % stride != 0 || (F.extent(d)-1)/stride < 3)
+        sampled = false;
+    if (!sampled && stride > 1)
+      continue;
+    T_accum dIs;
+    T_accum I = Reduce<N_rank>::uniform(F, dr.data(), dIs, stride, stride);
+    T_accum dR = (coarser ? (I-Ic)/15.0 : 0.0);
+    dI = std::max(abs(dR), abs(dIs));
+    if ((coarser && dI <= tol) || stride == 1)
+      return I+dR;
+    Ic = I;
+    coarser = true;
   }
-  blitz::TinyVector<T_numtype,1> dz(dr(2));
-  T_numtype I = integrate_t<T_numtype>(Iz, dz, dI);
-  dI += blitz::sum(dIz);
-  return I;
 }
 
+template<typename T_numtype, typename T_accum, int N_rank>
+T_accum integrateAdaptive(const blitz::Array<T_numtype,N_rank> &F,
+                          const blitz::TinyVector<T_accum,N_rank> &dr,
+                          T_accum tol, T_accum &dI)
+{
+  int stride;
+  return integrateAdaptive(F, dr, tol, dI, stride);
+}
+
+// Instantiated in integrate.cpp
+#define INTEGRATE_EXTERN(type,accum,dim)                                   \
+extern template accum integrate(const blitz::Array<type,dim> &F,           \
+                                const blitz::TinyVector<accum,dim> &dr,    \
+                                accum &dI);                                \
+extern template accum integrate(const blitz::Array<type,dim> &F,           \
+                                const blitz::TinyVector<accum,dim> &dr);
+
+INTEGRATE_EXTERN(float,float,1)
+INTEGRATE_EXTERN(float,float,2)
+INTEGRATE_EXTERN(float,float,3)
+
+INTEGRATE_EXTERN(float,double,1)
+INTEGRATE_EXTERN(float,double,2)
+INTEGRATE_EXTERN(float,double,3)
+
+INTEGRATE_EXTERN(double,double,1)
+INTEGRATE_EXTERN(double,double,2)
+INTEGRATE_EXTERN(double,double,3)
+
+#undef INTEGRATE_EXTERN
 
 #endif
@@ -0,0 +1,800 @@
+/**************************************************************************
+ *
+ * $Id$
+ *
+ * Copyright (c) 2000-2011 Patrick Guio <patrick.guio@gmail.com>
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2.  of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************/
+
+#ifndef PARSER_INDEX_H
+#define PARSER_INDEX_H
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <parser-watch.h>
+
+#if defined(HAVE_MPI)
+#include <mpi.h>
+#endif
+
+namespace parser {
+
+  // Input parameter file read once and indexed by option name, shared by
+  // all the Parser objects reading the same file. Lookups follow the
+  // semantics of the line by line scan of the file:
+  // - a line not starting with '#' or '%' of the form "name=value" or
+  //   "name value" gives the value of option name, the first such line
+  //   of the file is used
+  // - a line not starting with '#', '%' or '/' equal to name sets the
+  //   option without value
+  // The file is read in a single pass which also handles
+  // - "[prefix]" lines, the names that follow are read as prefix+name,
+  //   that is the name of the options inserted after setPrefix(prefix),
+  //   until the next such line, "[]" going back to no prefix
+  // - "#include file" lines, replaced by the content of file, relative to
+  //   the directory of the including file, read in the current section,
+  //   up to maxIncludeDepth nested includes
+  // - "name=[" values continued on the next lines up to the closing ']',
+  //   skipping blank and comment lines, the elements of the lines joined
+  //   with ',' as arrays, "name=[a,b]" on a single line being read as
+  //   "name=a,b"
+  // - values ending with ',' or with '\', which is removed, continued on
+  //   the next line if it is not a "name=value" line, skipping blank and
+  //   comment lines
+  // - ${VAR} and ${VAR:-default} in values and include file names,
+  //   replaced by the environment variable VAR, or by default if VAR is
+  //   unset or empty
+  // Entries are numbered in the order of the lines with the includes
+  // expanded.
+  // With HAVE_MPI and setBroadcast(true), only rank 0 of MPI_COMM_WORLD
+  // reads the file and broadcasts its index to the other ranks, so that
+  // the file system sees a single reader whatever the number of ranks.
+  // The broadcast is an explicit collective step, broadcast(), after
+  // which the Parser objects get the index from memory on every rank.
+  // With setCache(true), the index of a file read as text is saved as
+  // file.cache next to it, and mapped instead of reading the text as long
+  // as the file and its includes, and the environment variables used, are
+  // the same. A file with the modification time and size recorded in the
+  // cache is not read, another one is read and hashed to compare its
+  // contents.
+  // A file and its includes are watched once with watch(), whatever the
+  // number of Parser objects reading it, and update() reads it again once
+  // per change.
+  class InputIndex {
+  public:
+
+    typedef std::string string;
+
+    struct Entry {
+      string value;
+      int line;
+      Entry(const string &v, int l) : value(v), line(l) {}
+    };
+
+    typedef std::shared_ptr<const InputIndex> Ptr;
+
+    // Index of filename, read again only if the file or one of its
+    // includes has changed since it was last read. Returns a null pointer
+    // if the file cannot be read, throws std::runtime_error on a missing
+    // or recursive include. With reread the file is read again even if it
+    // looks unchanged. In broadcast mode the index is the one received by
+    // the last broadcast() of filename, without communication, and
+    // std::runtime_error is thrown if there was none.
+    static Ptr load(const string &filename, bool reread=false) {
+#if defined(HAVE_MPI)
+      if (broadcastRef()) {
+        Registry &r = registry();
+        std::lock_guard<std::mutex> guard(r.lock);
+        std::map<string, Ptr>::const_iterator i = r.sent.find(filename);
+        if (i == r.sent.end())
+          throw std::runtime_error("not broadcast, InputIndex::broadcast() "
+                                   "must be called first on all the ranks");
+        return i->second;
+      }
+#endif
+      return loadLocal(filename, reread);
+    }
+
+    // In broadcast mode, filename read by rank 0 and its index sent to the
+    // other ranks, where the environment variables are those of rank 0.
+    // Collective over MPI_COMM_WORLD, to be called by all the ranks in the
+    // same order and from a single thread, e.g. in main() before the Parser
+    // objects reading filename are constructed and then to read it again.
+    // The include errors are thrown on all the ranks. Same as load()
+    // otherwise.
+    static Ptr broadcast(const string &filename, bool reread=false) {
+#if defined(HAVE_MPI)
+      if (broadcastRef())
+        return loadBroadcast(filename, reread);
+#endif
+      return loadLocal(filename, reread);
+    }
+
+    // Broadcast mode, to be set identically on all the ranks before the
+    // first broadcast(). No effect without HAVE_MPI.
+    static void setBroadcast(bool on) {
+      broadcastRef() = on;
+    }
+
+    // Cache mode, to be set before the Parser objects are constructed
+    static void setCache(bool on) {
+      cacheRef() = on;
+    }
+
+    // Watch of filename and its includes for update(), with a single
+    // FileWatcher per file, polling at most every interval seconds of the
+    // first call if inotify is not available. With HAVE_MPI and several
+    // ranks the broadcast mode is required, so that all the ranks follow
+    // the changes seen by rank 0, and std::runtime_error is thrown
+    // otherwise.
+    static void watch(const string &filename, double interval=1.0) {
+#if defined(HAVE_MPI)
+      int size, rank;
+      MPI_Comm_size(MPI_COMM_WORLD, &size);
+      MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+      if (size > 1 && ! broadcastRef())
+        throw std::runtime_error("watched by several ranks, "
+                                 "InputIndex::setBroadcast(true) is required");
+      if (rank != 0)
+        return;
+#endif
+      Registry &r = registry();
+      std::lock_guard<std::mutex> guard(r.lock);
+      std::shared_ptr<FileWatcher> &watcher = r.watchers[filename];
+      if (watcher)
+        return;
+      watcher.reset(new FileWatcher(interval));
+      Ptr index(current(r, filename));
+      watcher->watch(index ? index->files() : std::vector<string>(1, filename));
+    }
+
+    // Last index of filename, read again first if one of the files watched
+    // with watch() has changed since the previous update() of any caller.
+    // If the file cannot be read again, std::runtime_error is thrown and
+    // the previous index is kept. In broadcast mode collective like
+    // broadcast(), following the changes seen by rank 0.
+    static Ptr update(const string &filename) {
+      Registry &r = registry();
+      int changed;
+      {
+        std::lock_guard<std::mutex> guard(r.lock);
+        WatcherMap::iterator w = r.watchers.find(filename);
+        changed = w != r.watchers.end() && w->second->changed();
+      }
+#if defined(HAVE_MPI)
+      if (broadcastRef())
+        MPI_Bcast(&changed, 1, MPI_INT, 0, MPI_COMM_WORLD);
+#endif
+      if (changed) {
+        Ptr fresh(broadcast(filename, true));
+        if (! fresh)
+          throw std::runtime_error("Cannot read input file '" + filename + "'");
+        std::lock_guard<std::mutex> guard(r.lock);
+        WatcherMap::iterator w = r.watchers.find(filename);
+        if (w != r.watchers.end())
+          w->second->watch(fresh->files());
+      }
+      std::lock_guard<std::mutex> guard(r.lock);
+      return current(r, filename);
+    }
+
+    // Value entry of name, 0 if there is none
+    const Entry *value(const string &name) const {
+      ValueMap::const_iterator i = values.find(name);
+      return i == values.end() ? 0 : &i->second;
+    }
+    // Entry number of the line equal to name, 0 if there is none
+    int flag(const string &name) const {
+      FlagMap::const_iterator i = flags.find(name);
+      return i == flags.end() ? 0 : i->second;
+    }
+
+    const string &fileName() const {
+      return filename;
+    }
+    // The file and its includes
+    std::vector<string> files() const {
+      std::vector<string> names;
+      for (size_t i=0; i<sources.size(); ++i)
+        names.push_back(sources[i].name);
+      return names;
+    }
+
+  private:
+
+    typedef std::unordered_map<string, Entry> ValueMap;
+    typedef std::unordered_map<string, int> FlagMap;
+
+    typedef unsigned long long hash_type;
+    typedef std::vector<std::pair<string, string> > Environment;
+    typedef std::pair<dev_t, ino_t> FileId;
+
+    enum { maxIncludeDepth = 64 };
+
+    // A file read into the index, the main file or an include
+    struct Source {
+      string name;
+      time_t mtime;
+      off_t size;
+      hash_type hash;
+      Source(const string &n, time_t t, off_t s, hash_type h) :
+        name(n), mtime(t), size(s), hash(h) {}
+    };
+
+    typedef std::map<string, std::shared_ptr<FileWatcher> > WatcherMap;
+
+    struct Registry {
+      std::mutex lock;
+      std::map<string, Ptr> files;
+      std::map<string, Ptr> sent;   // last index broadcast by rank 0,
+                                    // null if it was never read
+      WatcherMap watchers;          // files watched, on rank 0 only in
+                                    // broadcast mode
+    };
+
+    string filename;
+    std::vector<Source> sources;
+    Environment environment;      // variables used and their values
+    ValueMap values;
+    FlagMap flags;
+
+    explicit InputIndex(const string &_filename) :
+      filename(_filename), sources(), environment(), values(), flags() {}
+
+    static Registry &registry() {
+      static Registry r;
+      return r;
+    }
+    static bool &broadcastRef() {
+      static bool on = false;
+      return on;
+    }
+    static bool &cacheRef() {
+      static bool on = false;
+      return on;
+    }
+
+    // Last index of filename in the registry, locked by the caller
+    static Ptr current(Registry &r, const string &filename) {
+      const std::map<string, Ptr> &indexes = broadcastRef() ? r.sent : r.files;
+      std::map<string, Ptr>::const_iterator i = indexes.find(filename);
+      return i == indexes.end() ? Ptr() : i->second;
+    }
+
+    static Ptr loadLocal(const string &filename, bool reread) {
+      Registry &r = registry();
+      std::lock_guard<std::mutex> guard(r.lock);
+      Ptr &index = r.files[filename];
+      if (!index || reread || index->changed()) {
+        std::shared_ptr<InputIndex> fresh(new InputIndex(filename));
+        if (! cacheRef() || ! fresh->readCache()) {
+          std::vector<FileId> stack;
+          int count = 0;
+          if (! fresh->read(filename, string(), stack, count))
+            return Ptr();
+          if (cacheRef())
+            fresh->writeCache();
+        }
+        index = fresh;
+      }
+      return index;
+    }
+
+    bool changed() const {
+      for (size_t i=0; i<sources.size(); ++i) {
+        struct stat st;
+        if (stat(sources[i].name.c_str(), &st) != 0 ||
+            st.st_mtime != sources[i].mtime || st.st_size != sources[i].size)
+          return true;
+      }
+      return false;
+    }
+
+#if defined(HAVE_MPI)
+    // Rank 0 broadcasts the length of the serialized index, 0 if unchanged
+    // since the last broadcast, -1 if the file cannot be read, or minus 2
+    // plus the length of the message of an include error, then the index
+    // or the message. Every rank keeps the last index received in sent.
+    static Ptr loadBroadcast(const string &filename, bool reread) {
+      int rank;
+      MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+      Registry &r = registry();
+      string buffer;
+      long long length = 0;
+      Ptr index;
+      if (rank == 0) {
+        try {
+          index = loadLocal(filename, reread);
+        } catch (std::runtime_error &e) {
+          buffer = e.what();
+          length = -2-static_cast<long long>(buffer.size());
+        }
+        std::lock_guard<std::mutex> guard(r.lock);
+        std::map<string, Ptr>::const_iterator sent = r.sent.find(filename);
+        if (length == 0 && ! index) {
+          length = -1;
+        } else if (index && (sent == r.sent.end() || index != sent->second)) {
+          index->pack(buffer);
+          length = static_cast<long long>(buffer.size());
+        }
+      }
+      MPI_Bcast(&length, 1, MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+      size_t n = length < -1 ? static_cast<size_t>(-2-length) :
+                 length > 0 ? static_cast<size_t>(length) : 0;
+      if (n > 0) {
+        buffer.resize(n);
+        MPI_Bcast(&buffer[0], static_cast<int>(n), MPI_CHAR, 0,
+                  MPI_COMM_WORLD);
+      }
+      if (length < -1)
+        throw std::runtime_error(buffer);
+      if (rank != 0 && length > 0) {
+        std::shared_ptr<InputIndex> fresh(new InputIndex(filename));
+        Cursor c(buffer.data(), buffer.size());
+        fresh->unpack(c);
+        index = fresh;
+      }
+      std::lock_guard<std::mutex> guard(r.lock);
+      Ptr &sent = r.sent[filename];
+      if (length > 0)
+        sent = index;
+      return length < 0 ? Ptr() : sent;
+    }
+#endif
+
+    // Serialization as counts, lengths and line numbers in native byte
+    // order followed by the characters
+    static void put(string &buf, const void *x, size_t n) {
+      buf.append(static_cast<const char *>(x), n);
+    }
+    static void put(string &buf, int n) {
+      put(buf, &n, sizeof(n));
+    }
+    static void put(string &buf, const string &str) {
+      put(buf, static_cast<int>(str.size()));
+      buf.append(str);
+    }
+
+    // Reading of a serialized buffer, failing rather than reading past its
+    // end
+    struct Cursor {
+      const char *pos, *end;
+      bool fail;
+      Cursor(const char *buf, size_t n) : pos(buf), end(buf+n), fail(false) {}
+      const char *take(size_t n) {
+        if (fail || static_cast<size_t>(end-pos) < n) {
+          fail = true;
+          return 0;
+        }
+        pos += n;
+        return pos-n;
+      }
+      size_t left() const {
+        return static_cast<size_t>(end-pos);
+      }
+    };
+    template<typename T>
+    static T get(Cursor &c) {
+      T x = T();
+      const char *p = c.take(sizeof(x));
+      if (p)
+        std::memcpy(&x, p, sizeof(x));
+      return x;
+    }
+    static string getString(Cursor &c) {
+      int n = get<int>(c);
+      const char *p = n >= 0 ? c.take(static_cast<size_t>(n)) : 0;
+      return p ? string(p, static_cast<size_t>(n)) : string();
+    }
+
+    void pack(string &buf) const {
+      put(buf, static_cast<int>(values.size()));
+      for (ValueMap::const_iterator i=values.begin(); i!=values.end(); ++i) {
+        put(buf, i->first);
+        put(buf, i->second.value);
+        put(buf, i->second.line);
+      }
+      put(buf, static_cast<int>(flags.size()));
+      for (FlagMap::const_iterator i=flags.begin(); i!=flags.end(); ++i) {
+        put(buf, i->first);
+        put(buf, i->second);
+      }
+    }
+    // The counts are bounded by the entries that the rest of the buffer
+    // can hold, so that a corrupt count fails rather than allocates
+    bool unpack(Cursor &c) {
+      int n = get<int>(c);
+      values.reserve(std::min(static_cast<size_t>(n > 0 ? n : 0),
+                              c.left()/(3*sizeof(int))));
+      for (; n>0 && ! c.fail; --n) {
+        string name(getString(c));
+        string value(getString(c));
+        values.insert(ValueMap::value_type(name, Entry(value, get<int>(c))));
+      }
+      n = get<int>(c);
+      flags.reserve(std::min(static_cast<size_t>(n > 0 ? n : 0),
+                             c.left()/(2*sizeof(int))));
+      for (; n>0 && ! c.fail; --n) {
+        string name(getString(c));
+        flags.insert(FlagMap::value_type(name, get<int>(c)));
+      }
+      return ! c.fail;
+    }
+
+    // FNV-1a hash of the characters of a file
+    static hash_type hash(const char *first, const char *last) {
+      hash_type h = 14695981039346656037ULL;
+      for (; first != last; ++first)
+        h = (h ^ static_cast<unsigned char>(*first)) * 1099511628211ULL;
+      return h;
+    }
+    static bool readText(const string &file, string &text) {
+      std::ifstream fid(file.c_str(), std::ios::binary);
+      if (! fid)
+        return false;
+      text.assign(std::istreambuf_iterator<char>(fid),
+                  std::istreambuf_iterator<char>());
+      return true;
+    }
+
+    // The cache starts with a magic string and the byte order mark, then
+    // the sources with their hash, modification time and size, the
+    // environment variables and the index
+    static const char *cacheMagic() {
+      return "PARSIDX2";
+    }
+    static int byteOrder() {
+      return 0x01020304;
+    }
+    string cacheName() const {
+      return filename + ".cache";
+    }
+
+    // Index mapped from the cache, false if there is no cache, or it is out
+    // of date or cannot be read. A cache of touched files with the same
+    // contents is written again with their new times.
+    bool readCache() {
+      int fd = open(cacheName().c_str(), O_RDONLY);
+      if (fd < 0)
+        return false;
+      struct stat st;
+      void *map = MAP_FAILED;
+      if (fstat(fd, &st) == 0 && st.st_size > 0)
+        map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if (map == MAP_FAILED)
+        return false;
+      Cursor c(static_cast<const char *>(map), static_cast<size_t>(st.st_size));
+      bool ok = false, touched = false;
+      try {
+        ok = unpackCache(c, touched);
+      } catch (std::exception &) {
+        // e.g. std::bad_alloc on a corrupt cache, the text is read instead
+      }
+      munmap(map, st.st_size);
+      if (! ok) {
+        sources.clear();
+        environment.clear();
+        values.clear();
+        flags.clear();
+      } else if (touched) {
+        // same contents, recorded with the new times
+        writeCache();
+      }
+      return ok;
+    }
+    bool unpackCache(Cursor &c, bool &touched) {
+      const char *magic = c.take(std::strlen(cacheMagic()));
+      if (! magic || std::memcmp(magic, cacheMagic(), std::strlen(cacheMagic())) ||
+          get<int>(c) != byteOrder())
+        return false;
+      for (int n=get<int>(c); n>0 && ! c.fail; --n) {
+        string name(getString(c)), text;
+        hash_type h = get<hash_type>(c);
+        long long mtime = get<long long>(c), size = get<long long>(c);
+        struct stat st;
+        if (c.fail || stat(name.c_str(), &st) != 0)
+          return false;
+        // the contents compared only if the file has been touched
+        if (st.st_mtime != mtime || st.st_size != size) {
+          if (! readText(name, text) ||
+              hash(text.data(), text.data()+text.size()) != h)
+            return false;
+          touched = true;
+        }
+        sources.push_back(Source(name, st.st_mtime, st.st_size, h));
+      }
+      for (int n=get<int>(c); n>0 && ! c.fail; --n) {
+        string name(getString(c)), value(getString(c));
+        const char *env = std::getenv(name.c_str());
+        if (value != (env ? env : ""))
+          return false;
+        environment.push_back(Environment::value_type(name, value));
+      }
+      return ! c.fail && unpack(c) && c.pos == c.end;
+    }
+    // Index saved to the cache, written under a temporary name, unique to
+    // the host and process as the file may be shared by several nodes, and
+    // renamed so that concurrent readers see either cache entirely. A cache
+    // that cannot be written is not an error.
+    void writeCache() const {
+      string buf(cacheMagic());
+      put(buf, byteOrder());
+      put(buf, static_cast<int>(sources.size()));
+      for (size_t i=0; i<sources.size(); ++i) {
+        long long mtime = sources[i].mtime, size = sources[i].size;
+        put(buf, sources[i].name);
+        put(buf, &sources[i].hash, sizeof(hash_type));
+        put(buf, &mtime, sizeof(mtime));
+        put(buf, &size, sizeof(size));
+      }
+      put(buf, static_cast<int>(environment.size()));
+      for (size_t i=0; i<environment.size(); ++i) {
+        put(buf, environment[i].first);
+        put(buf, environment[i].second);
+      }
+      pack(buf);
+      std::ostringstream tmp;
+      char host[256] = "";
+      gethostname(host, sizeof(host)-1);
+      tmp << cacheName() << '.' << host << '.' << getpid();
+      std::ofstream fid(tmp.str().c_str(), std::ios::binary);
+      fid.write(buf.data(), buf.size());
+      fid.close();
+      if (fid.fail() || std::rename(tmp.str().c_str(), cacheName().c_str()) != 0)
+        std::remove(tmp.str().c_str());
+    }
+
+    // ${VAR} and ${VAR:-default} replaced in str, the variables used
+    // recorded in environment
+    string expand(const string &str) {
+      string::size_type begin = str.find("${");
+      if (begin == string::npos)
+        return str;
+      string out;
+      string::size_type pos = 0, end;
+      for (; begin != string::npos && (end=str.find('}', begin)) != string::npos;
+           begin = str.find("${", pos)) {
+        out.append(str, pos, begin-pos);
+        string name(str, begin+2, end-begin-2), def;
+        string::size_type sep = name.find(":-");
+        if (sep != string::npos) {
+          def = name.substr(sep+2);
+          name.erase(sep);
+        }
+        const char *env = std::getenv(name.c_str());
+        Environment::value_type var(name, env ? env : "");
+        if (std::find(environment.begin(), environment.end(), var) == environment.end())
+          environment.push_back(var);
+        out += env && *env ? string(env) : def;
+        pos = end+1;
+      }
+      out.append(str, pos, string::npos);
+      return out;
+    }
+
+    // Blank or comment line, skipped within continued values
+    static bool skipped(const string &line) {
+      string::size_type first = line.find_first_not_of(" \t\r");
+      return first == string::npos || line[first] == '#' || line[first] == '%';
+    }
+    // "name=value" line, with no blank before '='
+    static bool assignment(const string &line) {
+      string::size_type pos = line.find_first_of("= \t");
+      return pos != string::npos && pos > 0 && line[pos] == '=' &&
+             line[0] != '#' && line[0] != '%';
+    }
+    static string trim(const string &str) {
+      string::size_type first = str.find_first_not_of(" \t\r");
+      string::size_type last = str.find_last_not_of(" \t\r");
+      return first == string::npos ? string() : str.substr(first, last-first+1);
+    }
+
+    // Value of lines[k] read from pos, continued on the next lines, k
+    // being left on the last line read
+    static string value(const std::vector<string> &lines, size_t &k,
+                        string::size_type pos) {
+      string value(lines[k].substr(pos)), first(trim(value));
+      if (! first.empty() && first[0] == '[' &&
+          (first.find(']') == string::npos || first[first.size()-1] == ']')) {
+        // elements up to the closing bracket
+        string array;
+        string part(first.substr(1));
+        for (;;) {
+          string::size_type close = part.find(']');
+          string elements(trim(part.substr(0, close)));
+          if (! elements.empty()) {
+            if (! array.empty() && array[array.size()-1] != ',' &&
+                elements[0] != ',')
+              array += ',';
+            array += elements;
+          }
+          if (close != string::npos || k+1 == lines.size())
+            break;
+          do {
+            ++k;
+          } while (k+1 < lines.size() && skipped(lines[k]));
+          part = skipped(lines[k]) ? string() : lines[k];
+        }
+        return array;
+      }
+      // continued with ',' or '\' unless the next line is an assignment
+      for (string::size_type last = value.find_last_not_of(" \t\r");
+           last != string::npos && (value[last] == ',' || value[last] == '\\');
+           last = value.find_last_not_of(" \t\r")) {
+        size_t next = k+1;
+        while (next < lines.size() && skipped(lines[next]))
+          ++next;
+        if (next == lines.size() || assignment(lines[next]))
+          break;
+        value.erase(value[last] == ',' ? last+1 : last);
+        value.append(lines[next], lines[next].find_first_not_of(" \t"),
+                     string::npos);
+        k = next;
+      }
+      return value;
+    }
+
+    // Whether line is an "#include file" directive, name being set to the
+    // included file name, empty if it expands to nothing
+    bool includeName(const string &line, const string &from, string &name) {
+      if (line.compare(0, 8, "#include") != 0 || line.size() == 8 ||
+          (line[8] != ' ' && line[8] != '\t' && line[8] != '"'))
+        return false;
+      string::size_type first = line.find_first_not_of(" \t\"", 8);
+      string::size_type last = line.find_last_not_of(" \t\r\"");
+      if (first == string::npos || last < first)
+        return false;
+      name = expand(line.substr(first, last-first+1));
+      string::size_type slash = from.rfind('/');
+      if (! name.empty() && name[0] != '/' && slash != string::npos)
+        name.insert(0, from, 0, slash+1);
+      return true;
+    }
+
+    // Reads file into the index within section prefix, count being the
+    // number of lines read so far and stack the chain of includes, as
+    // device and inode so that a file reached by different paths is
+    // recognised. Returns false if file cannot be opened.
+    bool read(const string &file, string prefix, std::vector<FileId> &stack,
+              int &count) {
+      string text;
+      struct stat st;
+      if (! readText(file, text) || stat(file.c_str(), &st) != 0)
+        return false;
+      FileId id(st.st_dev, st.st_ino);
+      if (std::find(stack.begin(), stack.end(), id) != stack.end())
+        throw std::runtime_error("Recursive include of '" + file + "'");
+      if (stack.size() > static_cast<size_t>(maxIncludeDepth)) {
+        std::ostringstream os;
+        os << "More than " << maxIncludeDepth << " nested includes at '"
+           << file << "'";
+        throw std::runtime_error(os.str());
+      }
+      stack.push_back(id);
+      sources.push_back(Source(file, st.st_mtime, st.st_size,
+                               hash(text.data(), text.data()+text.size())));
+      std::vector<string> lines;
+      std::istringstream fid(text);
+      for (string line; std::getline(fid, line); )
+        lines.push_back(line);
+      // entries numbered after the lines read before, includes expanded
+      int base = count;
+      for (size_t k=0; k<lines.size(); ++k) {
+        const string &line = lines[k];
+        int n = static_cast<int>(k+1), entry = base+n;
+        char c = line.empty() ? '\0' : line[0];
+        if (c == '#') {
+          string name;
+          bool include = includeName(line, file, name);
+          count = entry;
+          bool found = ! include ||
+                       (! name.empty() && read(name, prefix, stack, count));
+          base = count-n;
+          if (! found) {
+            std::ostringstream os;
+            os << "Cannot open file '" << name << "' included from '"
+               << file << "' line " << n;
+            if (name.empty())
+              os << ", empty name";
+            throw std::runtime_error(os.str());
+          }
+          continue;
+        }
+        if (c == '%')
+          continue;
+        if (c == '[') {
+          string::size_type last = line.find_last_not_of(" \t\r");
+          if (line[last] == ']') {
+            prefix = line.substr(1, last-1);
+            continue;
+          }
+        }
+        string::size_type pos = line.find_first_of("= ");
+        // insert() keeps the first line
+        if (pos != string::npos) {
+          string name(prefix+line.substr(0, pos));
+          values.insert(ValueMap::value_type(name,
+                          Entry(expand(value(lines, k, pos+1)), entry)));
+        }
+        if (c != '/')
+          flags.insert(FlagMap::value_type(prefix+line, entry));
+      }
+      count = base+static_cast<int>(lines.size());
+      stack.pop_back();
+      return true;
+    }
+  };
+
+  // Command line arguments indexed by value, built once by the Parser
+  // constructor from the arguments split at '='
+  class ArgIndex {
+  public:
+
+    typedef std::string string;
+    typedef std::vector<int> Positions;
+
+    ArgIndex() : args(), positions() {}
+
+    template <class List>
+    void build(const List &list) {
+      args.assign(list.begin(), list.end());
+      positions.clear();
+      for (size_t i=0; i<args.size(); ++i)
+        positions[args[i]].push_back(static_cast<int>(i));
+    }
+
+    // Positions of the arguments equal to name in increasing order, 0 if
+    // there is none
+    const Positions *find(const string &name) const {
+      PositionMap::const_iterator i = positions.find(name);
+      return i == positions.end() ? 0 : &i->second;
+    }
+    // Argument following position pos, 0 if pos is the last one
+    const string *next(int pos) const {
+      return pos+1 < static_cast<int>(args.size()) ? &args[pos+1] : 0;
+    }
+
+  private:
+
+    typedef std::unordered_map<string, Positions> PositionMap;
+
+    std::vector<string> args;
+    PositionMap positions;
+  };
+
+} // namespace parser
+
+#endif // PARSER_INDEX_H
@@ -0,0 +1,176 @@
+/**************************************************************************
+ *
+ * $Id$
+ *
+ * Copyright (c) 2000-2011 Patrick Guio <patrick.guio@gmail.com>
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2.  of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************/
+
+#ifndef PARSER_WATCH_H
+#define PARSER_WATCH_H
+
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace parser {
+
+  // Watch of a set of files, changed() telling whether one of them has
+  // been written or replaced since the previous call. On Linux inotify
+  // watches the directories of the files, so that files replaced by a
+  // rename as editors do are seen, and changed() costs a non-blocking
+  // read(). Elsewhere, or if inotify is not available, the files are
+  // polled with stat() at most every interval seconds.
+  class FileWatcher {
+  public:
+
+    typedef std::string string;
+
+    explicit FileWatcher(double _interval=1.0) :
+      fd(-1), interval(_interval), last(0), files() {}
+
+    ~FileWatcher() {
+      close();
+    }
+
+    FileWatcher(const FileWatcher &) = delete;
+    FileWatcher &operator=(const FileWatcher &) = delete;
+
+    // Files to watch, replacing the previous ones
+    void watch(const std::vector<string> &names) {
+      close();
+      files.clear();
+      for (size_t i=0; i<names.size(); ++i) {
+        File f;
+        string::size_type slash = names[i].rfind('/');
+        f.name = names[i];
+        f.dir = slash == string::npos ? string(".") : names[i].substr(0, slash+1);
+        f.base = slash == string::npos ? names[i] : names[i].substr(slash+1);
+        f.stamp = stamp(f.name);
+        files.push_back(f);
+      }
+#if defined(__linux__)
+      fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+      for (size_t i=0; fd >= 0 && i<files.size(); ++i) {
+        int wd = inotify_add_watch(fd, files[i].dir.c_str(),
+                                   IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd < 0)
+          close();
+        else
+          files[i].wd = wd;
+      }
+#endif
+      last = std::time(0);
+    }
+
+    bool changed() {
+#if defined(__linux__)
+      if (fd >= 0)
+        return readEvents();
+#endif
+      std::time_t now = std::time(0);
+      if (files.empty() || std::difftime(now, last) < interval)
+        return false;
+      last = now;
+      bool modified = false;
+      for (size_t i=0; i<files.size(); ++i) {
+        Stamp s(stamp(files[i].name));
+        if (s != files[i].stamp) {
+          files[i].stamp = s;
+          modified = true;
+        }
+      }
+      return modified;
+    }
+
+    bool usesInotify() const {
+      return fd >= 0;
+    }
+
+  private:
+
+    struct Stamp {
+      std::time_t mtime;
+      off_t size;
+      ino_t ino;
+      bool operator!=(const Stamp &s) const {
+        return mtime != s.mtime || size != s.size || ino != s.ino;
+      }
+    };
+
+    struct File {
+      string name, dir, base;
+      int wd;
+      Stamp stamp;
+      File() : name(), dir(), base(), wd(-1), stamp() {}
+    };
+
+    int fd;
+    double interval;
+    std::time_t last;
+    std::vector<File> files;
+
+    static Stamp stamp(const string &name) {
+      struct stat st;
+      Stamp s = { 0, -1, 0 };
+      if (stat(name.c_str(), &st) == 0) {
+        s.mtime = st.st_mtime;
+        s.size = st.st_size;
+        s.ino = st.st_ino;
+      }
+      return s;
+    }
+
+    void close() {
+#if defined(__linux__)
+      if (fd >= 0)
+        ::close(fd);
+#endif
+      fd = -1;
+    }
+
+#if defined(__linux__)
+    // Drains the pending events, true if one of them is about a file
+    bool readEvents() {
+      bool modified = false;
+      alignas(inotify_event) char buffer[4096];
+      ssize_t n;
+      while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (char *p=buffer; p<buffer+n; ) {
+          const inotify_event *e = reinterpret_cast<const inotify_event *>(p);
+          for (size_t i=0; e->len > 0 && i<files.size(); ++i)
+            if (files[i].wd == e->wd && files[i].base == e->name)
+              modified = true;
+          p += sizeof(inotify_event)+e->len;
+        }
+      }
+      return modified;
+    }
+#endif
+  };
+
+} // namespace parser
+
+#endif // PARSER_WATCH_H
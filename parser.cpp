@@ -20,8 +20,11 @@
  *
  **************************************************************************/
 
+#include <cerrno>
 #include <cmath>
+#include <cstdlib>
 #include <cstring>
+#include <limits>
 
 #include <unistd.h>        // only needed for definition of gethostname
 #include <sys/param.h>     // only needed for definition of MAXHOSTNAMELEN
@@ -35,6 +38,62 @@ using std::getline;
 
 namespace parser {
 
+  namespace {
+
+    // strtol() conversion of the characters [first,last) to an integer of
+    // type T, which fails on a value out of range and on leftover
+    // characters if fail is set
+    template<typename T>
+    bool toInteger(const char *first, const char *last, T &x, bool fail)
+    {
+      char *end;
+      errno = 0;
+      long v = strtol(first, &end, 10);
+      if (end == first || end > last || errno == ERANGE ||
+          v < std::numeric_limits<T>::min() ||
+          v > std::numeric_limits<T>::max() || (fail && end != last))
+        return false;
+      x = static_cast<T>(v);
+      return true;
+    }
+
+    // strtod() conversion of the characters [first,last) to a real of type
+    // T, followed by an optional operator and operand as in 1/3, 2*pi or
+    // 10^-3, characters after are ignored
+    template<typename T>
+    bool toReal(const char *first, const char *last, T &x)
+    {
+      char *end;
+      double v = strtod(first, &end);
+      if (end == first || end > last || v != v ||
+          std::fabs(v) > std::numeric_limits<T>::max())
+        return false;
+      if (end < last) {
+        char c = *end, *end2;
+        double y = strtod(end+1, &end2);
+        if (end2 != end+1 && end2 <= last) {
+          switch (c) {
+          case '/':
+            v /= y;
+            break;
+          case '*':
+            v *= y;
+            break;
+          case '^':
+            v = pow(v, y);
+            break;
+          default:
+            std::string op(1, c);
+            throw  ParserException("Operator '" + op + "' not supported\n");
+          }
+        }
+      }
+      x = static_cast<T>(v);
+      return true;
+    }
+
+  }
+
   Parser::ValueDescPair v_mapInit[] = {
     Parser::ValueDescPair(types::none      ,         ""),
     Parser::ValueDescPair(types::boolean   ,     "bool"),
@@ -55,11 +114,12 @@ namespace parser {
   Parser::ValuesDescList Parser::TypeValues(v_mapInit, v_mapInitEnd);
 
   Parser::Parser(int nargs, char* args []) :
-    Cmd(), Args(0),
+    Cmd(), Args(0), ArgsIndex(),
     Options(), OptionsDefaultValue(), OptionType(), OptionDesc(),
     className(), packageName(), numVersion(), copyrightText(), progName(),
     prefixName(), debugParser(false), classDebugLevel(0), inputFileName(),
-    inputFileNameParsed(false)
+    inputFileNameParsed(false), inputIndex(), inputWatched(false), inputCallbacks(),
+    registryLock()
   {
 #if defined(HAVE_MPI)
     MPI_Comm_size(MPI_COMM_WORLD, &nbProc);
@@ -85,9 +145,11 @@ namespace parser {
         debugParser = true;
       }
     }
+    ArgsIndex.build(Args);
 
     if (debugParser) {
       viewArgs(cout);
+      OutputLock output(outputMutex());
       viewOptions(cout);
     }
 
@@ -108,8 +170,14 @@ namespace parser {
     insertOptionAlias(_file,"--input");
 
     if ((inputFileNameParsed = parseOption(_file, inputFileName, cmdLine))) {
-      ifstream fid(inputFileName.c_str());
-      if (! fid)
+      // read and indexed once, shared with the other parsers of the file
+      try {
+        inputIndex = InputIndex::load(inputFileName);
+      } catch (std::runtime_error &e) {
+        throw ParserException("Input file '" + inputFileName + "': " +
+                              e.what() + "\n");
+      }
+      if (! inputIndex)
         throw ParserException("Input file '" + inputFileName + "' not found\n");
     }
   }
@@ -117,14 +185,42 @@ namespace parser {
   Parser::~Parser()
   {}
 
+  void Parser::broadcastInputFile(int nargs, char* args [])
+  {
+    // arguments split at '=' as in the constructor
+    std::vector<string> list;
+    for (int i=1; i<nargs; ++i) {
+      string str(args[i]);
+      stringSizeType pos = str.find('=');
+      if (pos == string::npos || pos == str.length()-1) {
+        list.push_back(str);
+      } else {
+        list.push_back(str.substr(0, pos));
+        list.push_back(str.substr(pos+1));
+      }
+    }
+    for (size_t i=0; i+1<list.size(); ++i) {
+      if (list[i] == "-i" || list[i] == "--input") {
+        try {
+          InputIndex::broadcast(list[i+1]);
+        } catch (std::runtime_error &e) {
+          throw ParserException("Input file '" + list[i+1] + "': " +
+                                e.what() + "\n");
+        }
+        return;
+      }
+    }
+  }
+
 
   void Parser::printCmd(std::ostream &os) const
   {
     time_t rawtime;
-    struct tm *timeinfo;
+    struct tm timeinfo;
+    char date[32];
     time(&rawtime);
-    timeinfo = localtime(&rawtime);
-    os << "date        : " << asctime(timeinfo);
+    localtime_r(&rawtime, &timeinfo);
+    os << "date        : " << asctime_r(&timeinfo, date);
 
     char hostname[MAXHOSTNAMELEN];
     gethostname(hostname, MAXHOSTNAMELEN);
@@ -143,6 +239,7 @@ namespace parser {
 
   void Parser::viewArgs(std::ostream &os) const
   {
+    OutputLock output(outputMutex());
     cout
         << "*****************" << endl
         << "Passed arguments:" << endl;
@@ -155,17 +252,20 @@ namespace parser {
 
   void Parser::registerClass(const string &name)
   {
+    WriteLock lock(registryLock.mutex);
     className = name;
   }
 
   void Parser::registerProgram(const string &name)
   {
+    WriteLock lock(registryLock.mutex);
     progName = name;
   }
 
   void Parser::registerPackage(const string &package, const string &version,
                                const string &copyright)
   {
+    WriteLock lock(registryLock.mutex);
     packageName   = package;
     numVersion    = version;
     copyrightText = copyright;
@@ -173,18 +273,22 @@ namespace parser {
 
   void Parser::setPrefix(const string name)
   {
+    WriteLock lock(registryLock.mutex);
     prefixName = name;
   }
 
   void Parser::insertOption(keyType key, const string name, valueType type,
                             const string desc, const Any &defval)
   {
+    WriteLock lock(registryLock.mutex);
     if (debugParser) {
+      OutputLock output(outputMutex());
       cerr << "insertOption(" << key << "," <<
            name << "," << type << "," << desc << ")" << endl;
       viewOptions(cerr);
     }
     if ( OptionType.find(key) != OptionType.end() ) {
+      OutputLock output(outputMutex());
       cerr << "*** Warning : " <<
            "option (" << key << ","
            << TypeValues.find(OptionType.find(key)->second)->second << ")";
@@ -207,11 +311,14 @@ namespace parser {
 
   void Parser::insertOptionAlias(keyType key, const string alias)
   {
+    WriteLock lock(registryLock.mutex);
     if (debugParser) {
+      OutputLock output(outputMutex());
       cerr << "insertOptionAlias(" << key << "," << alias << ")" << endl;
       viewOptions(cerr);
     }
     if ( OptionType.find(key) == OptionType.end() ) {
+      OutputLock output(outputMutex());
       cerr << "*** Warning : key " << key;
       if (! className.empty())
         cerr << " in class '" << className << "'";
@@ -229,17 +336,102 @@ namespace parser {
   void Parser::parseLevelDebugOption(const string name)
   {
     keyType key = _last+1;
+    int level = debugLevel();
     insertOption(key, name, types::integer,
-                 "Level of debug information", Any(classDebugLevel));
-    parseOption(key, classDebugLevel);
+                 "Level of debug information", Any(level));
+    parseOption(key, level);
+    WriteLock lock(registryLock.mutex);
+    classDebugLevel = level;
   }
 
   int Parser::debugLevel() const
   {
+    ReadLock lock(registryLock.mutex);
     return classDebugLevel;
   }
 
+  void Parser::watchInputFile(double interval)
+  {
+    WriteLock lock(registryLock.mutex);
+    if (! inputFileNameParsed)
+      return;
+    // shared with the other parsers of the file
+    try {
+      InputIndex::watch(inputFileName, interval);
+    } catch (std::runtime_error &e) {
+      throw ParserException("Input file '" + inputFileName + "': " +
+                            e.what() + "\n");
+    }
+    inputWatched = true;
+  }
+
+  void Parser::onInputChange(keyType key, const std::function<void()> &callback)
+  {
+    WriteLock lock(registryLock.mutex);
+    if (isKeyDefined(key))
+      inputCallbacks.push_back(CallbackList::value_type(key, callback));
+  }
 
+  bool Parser::reloadInputFile()
+  {
+    {
+      ReadLock lock(registryLock.mutex);
+      if (! inputWatched)
+        return false;
+    }
+    // collective in broadcast mode, so out of the lock of the parser
+    InputIndex::Ptr fresh;
+    try {
+      fresh = InputIndex::update(inputFileName);
+    } catch (std::runtime_error &e) {
+      OutputLock output(outputMutex());
+      cerr << "*** Warning: " << e.what()
+           << "\tKeeping previous values..." << endl;
+      return false;
+    }
+
+    // the callbacks are called once the lock is released, they may parse
+    // options again
+    std::vector<std::function<void()> > calls;
+    {
+      WriteLock lock(registryLock.mutex);
+      // read again by this parser or by another one of the file
+      if (! fresh || fresh == inputIndex)
+        return false;
+
+      InputIndex::Ptr previous(inputIndex);
+      inputIndex = fresh;
+
+      if (OptionType.find(_last+1) != OptionType.end()) {
+        try {
+          findOption(_last+1, classDebugLevel, inpFile_cmdLine);
+        } catch (ParserException &e) {
+          OutputLock output(outputMutex());
+          cerr << "*** Warning: " << e.what() << endl;
+        }
+      }
+      for (CallbackList::const_iterator c=inputCallbacks.begin();
+           c!=inputCallbacks.end(); ++c) {
+        const InputIndex::Entry *a = inputEntry(*previous, c->first);
+        const InputIndex::Entry *b = inputEntry(*inputIndex, c->first);
+        if ((a == 0) != (b == 0) || (a && a->value != b->value) ||
+            inputFlag(*previous, c->first) != inputFlag(*inputIndex, c->first))
+          calls.push_back(c->second);
+      }
+    }
+    for (size_t i=0; i<calls.size(); ++i)
+      calls[i]();
+    return true;
+  }
+
+
+  std::mutex &Parser::outputMutex()
+  {
+    static std::mutex m;
+    return m;
+  }
+
+  // The caller holds outputMutex(), the warning is part of its output
   void Parser::formatString(string &str, unsigned t)
   {
     if ( str.size() < t ) {
@@ -356,7 +548,9 @@ namespace parser {
 
   bool Parser::parseHelp() const
   {
-    if (parseOption(_help, cmdLine)) {
+    ReadLock lock(registryLock.mutex);
+    if (findOption(_help, cmdLine)) {
+      OutputLock output(outputMutex());
       if (! className.empty()) {
         cerr << "Registered options for class '" << className <<"':\n" << endl;
       } else if (! progName.empty()) {
@@ -372,7 +566,9 @@ namespace parser {
 
   bool Parser::parseVersion() const
   {
-    if (parseOption(_version, cmdLine)) {
+    ReadLock lock(registryLock.mutex);
+    if (findOption(_version, cmdLine)) {
+      OutputLock output(outputMutex());
       if (! packageName.empty()) {
         if (! className.empty()) {
           cerr << "Class '" << className << "'";
@@ -391,7 +587,9 @@ namespace parser {
 
   bool Parser::parseTemplate() const
   {
-    if (parseOption(_template, cmdLine)) {
+    ReadLock lock(registryLock.mutex);
+    if (findOption(_template, cmdLine)) {
+      OutputLock output(outputMutex());
       if (! className.empty()) {
         string header;
         header = "\n## Options for class : " + className;
@@ -416,7 +614,8 @@ namespace parser {
       if (! progName.empty()) {
         string header("\n## Automatically generated template setup file");
         const time_t now(time(0));
-        string str_now(ctime(&now));
+        char date[32];
+        string str_now(ctime_r(&now, date));
         str_now.erase(str_now.size()-1);
         header = header + "\n## Date              : " + str_now;
         string hashes(last_tab,'#');
@@ -434,69 +633,61 @@ namespace parser {
   }
 
   bool Parser::parseCmdLine(keyType key) const
+  {
+    ReadLock lock(registryLock.mutex);
+    return findCmdLine(key);
+  }
+
+  bool Parser::parseInpFile(keyType key) const
+  {
+    ReadLock lock(registryLock.mutex);
+    return findInpFile(key);
+  }
+
+  bool Parser::parseOption(keyType key, parseMode mode) const
+  {
+    ReadLock lock(registryLock.mutex);
+    return findOption(key, mode);
+  }
+
+  bool Parser::findCmdLine(keyType key) const
   {
     if (! isKeyDefined(key))
       return false;
 
-    ArgListConstIter A;
     OptionListConstIter O;
-    for (A=Args.begin(); A!=Args.end(); ++A) {
-      string arg(*A);
-      for (O=Options.find(key); O!=Options.upper_bound(key); ++O) {
-        string option(O->second);
-        if (arg == option) {
-          return true;
-        }
-      }
+    for (O=Options.find(key); O!=Options.upper_bound(key); ++O) {
+      if (ArgsIndex.find(O->second))
+        return true;
     }
     return false;
   }
 
-  bool Parser::parseInpFile(keyType key) const
+  bool Parser::findInpFile(keyType key) const
   {
     if (! isKeyDefined(key) || ! inputFileNameParsed)
       return false;
 
-    // there is no "nocreate" in StdC++ :(
-    // ios::in is default
-    ifstream fid(inputFileName.c_str());
-    if (! fid)
-      throw ParserException("Cannot open file '" + inputFileName + "'\n");
-
-    // automatic memory management, also doesn't overflow
-    string line;
-    OptionListConstIter O;
-    // fixes the usual eof() bug
-    while (getline(fid, line)) {
-      if (line[0]!='#' && line[0]!='%' && (line[0]!='/' && line[0]!='/')) {
-        for (O=Options.find(key); O!=Options.upper_bound(key); ++O) {
-          string option(O->second);
-          if (line == option) {
-            return true;
-          }
-        }
-      }
-    }
-    return false;
+    return inputFlag(*inputIndex, key);
   }
 
-  bool Parser::parseOption(keyType key, parseMode mode) const
+  bool Parser::findOption(keyType key, parseMode mode) const
   {
     try {
 
       bool parsed = false;
       switch (mode) {
       case inpFile:
-        parsed = parseInpFile(key);
+        parsed = findInpFile(key);
         break;
       case cmdLine:
-        parsed = parseCmdLine(key);
+        parsed = findCmdLine(key);
         break;
       case inpFile_cmdLine:
-        parsed = parseInpFile(key) | parseCmdLine(key);
+        parsed = findInpFile(key) | findCmdLine(key);
         break;
       case cmdLine_inpFile:
-        parsed = parseCmdLine(key) | parseInpFile(key);
+        parsed = findCmdLine(key) | findInpFile(key);
         break;
       }
       return parsed;
@@ -514,6 +705,7 @@ namespace parser {
 
   void Parser::checkMap(keyType key, const LUT &_map, int value) const
   {
+    ReadLock lock(registryLock.mutex);
     if (! isKeyDefined(key))
       return;
 
@@ -531,9 +723,34 @@ namespace parser {
     }
   }
 
+  const InputIndex::Entry *Parser::inputEntry(const InputIndex &index,
+                                              keyType key) const
+  {
+    // the first line of the file setting any of the aliases
+    const InputIndex::Entry *found = 0;
+    OptionListConstIter O;
+    for (O=Options.find(key); O!=Options.upper_bound(key); ++O) {
+      const InputIndex::Entry *e = index.value(O->second);
+      if (e && (! found || e->line < found->line))
+        found = e;
+    }
+    return found;
+  }
+
+  bool Parser::inputFlag(const InputIndex &index, keyType key) const
+  {
+    OptionListConstIter O;
+    for (O=Options.find(key); O!=Options.upper_bound(key); ++O) {
+      if (index.flag(O->second))
+        return true;
+    }
+    return false;
+  }
+
   bool Parser::isKeyDefined(keyType key) const
   {
     if (OptionType.find(key) == OptionType.end()) {
+      OutputLock output(outputMutex());
       cerr << "*** Warning: Undefined key '" << key
            << "'\tSkipping..." << endl;
       return false;
@@ -568,61 +785,59 @@ namespace parser {
   template<>
   void Parser::convert(const string &str, float &value, bool failIfLeftoverChars)
   {
-    istringstream is(str);
-    char c;
-    float x;
-
-    if (!(is >> x)) {
+    if (! toReal(str.c_str(), str.c_str()+str.size(), value))
       throw  BadConversion(str);
-    } else {
-      value = x;
-      if (is.get(c) && is >> x) {
-        switch (c) {
-        case '/':
-          value /= x;
-          break;
-        case '*':
-          value *= x;
-          break;
-        case '^':
-          value = powf(value, x);
-          break;
-        default:
-          string op(1, c);
-          throw  ParserException("Operator '" + op + "' not supported\n");
-        }
-      }
-    }
   }
 
   template<>
   void Parser::convert(const string &str, double &value, bool failIfLeftoverChars)
   {
-    istringstream is(str);
-    char c;
-    float x;
+    if (! toReal(str.c_str(), str.c_str()+str.size(), value))
+      throw  BadConversion(str);
+  }
 
-    if (!(is >> x)) {
+  template<>
+  void Parser::convert(const string &str, int &value, bool failIfLeftoverChars)
+  {
+    if (! toInteger(str.c_str(), str.c_str()+str.size(), value,
+                    failIfLeftoverChars))
       throw  BadConversion(str);
-    } else {
-      value = x;
-      if (is.get(c) && is >> x) {
-        switch (c) {
-        case '/':
-          value /= x;
-          break;
-        case '*':
-          value *= x;
-          break;
-        case '^':
-          value = (double)pow((double)value, (double)x);
-          break;
-        default:
-          string op(1, c);
-          throw  ParserException("Operator '" + op + "' not supported\n");
-        }
-      }
-    }
+  }
+
+  template<>
+  void Parser::convert(const string &str, long &value, bool failIfLeftoverChars)
+  {
+    if (! toInteger(str.c_str(), str.c_str()+str.size(), value,
+                    failIfLeftoverChars))
+      throw  BadConversion(str);
+  }
+
+  template<>
+  void Parser::convertRange(const char *first, const char *last, int &value)
+  {
+    if (! toInteger(first, last, value, true))
+      throw  BadConversion(string(first, last));
+  }
+
+  template<>
+  void Parser::convertRange(const char *first, const char *last, long &value)
+  {
+    if (! toInteger(first, last, value, true))
+      throw  BadConversion(string(first, last));
+  }
+
+  template<>
+  void Parser::convertRange(const char *first, const char *last, float &value)
+  {
+    if (! toReal(first, last, value))
+      throw  BadConversion(string(first, last));
+  }
+
+  template<>
+  void Parser::convertRange(const char *first, const char *last, double &value)
+  {
+    if (! toReal(first, last, value))
+      throw  BadConversion(string(first, last));
   }
 
 
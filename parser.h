@@ -23,16 +23,23 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include <algorithm>
+#include <functional>
 #include <list>
 #include <map>
+#include <mutex>
 #include <vector>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <string>
 #include <stdexcept>
+#if __cplusplus >= 201402L
+#include <shared_mutex>
+#endif
 
 #include <any.h>
+#include <parser-index.h>
 
 #if defined(HAVE_MPI)
 #include <mpi.h>
@@ -141,6 +148,12 @@ namespace parser {
     explicit Parser(int nargs=0, char* args []=0);
     virtual ~Parser();
 
+    // With InputIndex::setBroadcast(true), the input file of the -i/--input
+    // argument read by rank 0 and sent to the other ranks, to be called by
+    // all the ranks before constructing the Parser objects, which then do
+    // not communicate. Collective, see InputIndex::broadcast().
+    static void broadcastInputFile(int nargs, char* args []);
+
     void printCmd(std::ostream &os) const;
     void viewArgs(std::ostream &os) const;
 
@@ -158,6 +171,9 @@ namespace parser {
     void parseLevelDebugOption(const string name);
     int debugLevel() const;
 
+    // The lookups, from here to parseOptions(), can be called concurrently
+    // from several threads. Registration and reloadInputFile() hold the
+    // lock of the parser exclusively and the diagnostics are written whole.
     virtual bool parseHelp() const;
     virtual bool parseVersion() const;
     virtual bool parseTemplate() const;
@@ -178,6 +194,22 @@ namespace parser {
     template<class T>
     bool parseOptions(keyType key, std::vector<T> &value) const;
 
+    // Live reload of the input file, opted in with watchInputFile() and
+    // done where the program calls reloadInputFile(), at a point where the
+    // options can safely change. The debug level option is parsed again
+    // and the callbacks of the options whose value or flag has changed in
+    // the file are called. The file is watched once and read again once
+    // per change whatever the number of parsers reading it. With HAVE_MPI
+    // and several ranks watchInputFile() requires the broadcast mode,
+    // InputIndex::setBroadcast(true) and broadcastInputFile(), and
+    // reloadInputFile() is collective and follows the changes seen by
+    // rank 0. reloadInputFile() is to be called from a single thread, on
+    // all the ranks in the same order, while the other threads may go on
+    // with the lookups.
+    void watchInputFile(double interval=1.0);
+    void onInputChange(keyType key, const std::function<void()> &callback);
+    bool reloadInputFile();
+
   protected:
 
 #if defined(HAVE_MPI)
@@ -202,6 +234,7 @@ namespace parser {
 
     string Cmd;
     ArgList Args;
+    ArgIndex ArgsIndex;
     OptionList Options;
     ValueList OptionsDefaultValue;
     OptionValueList OptionType;
@@ -221,6 +254,38 @@ namespace parser {
 
     std::string inputFileName;
     bool inputFileNameParsed;
+    InputIndex::Ptr inputIndex;
+
+    typedef std::vector<std::pair<keyType, std::function<void()> > > CallbackList;
+
+    bool inputWatched;
+    CallbackList inputCallbacks;
+
+    // Shared by the lookups, exclusive for registration. Before C++14
+    // there is no shared mutex and the lookups are serialized.
+#if __cplusplus >= 201402L
+    typedef std::shared_timed_mutex RegistryMutex;
+    typedef std::shared_lock<RegistryMutex> ReadLock;
+#else
+    typedef std::mutex RegistryMutex;
+    typedef std::lock_guard<RegistryMutex> ReadLock;
+#endif
+    typedef std::lock_guard<RegistryMutex> WriteLock;
+    typedef std::lock_guard<std::mutex> OutputLock;
+
+    // A copy of the parser gets a mutex of its own
+    struct Lock {
+      mutable RegistryMutex mutex;
+      Lock() : mutex() {}
+      Lock(const Lock &) : mutex() {}
+      Lock &operator=(const Lock &) {
+        return *this;
+      }
+    };
+    Lock registryLock;
+
+    // Serializes the writes to cout and cerr of all the parsers
+    static std::mutex &outputMutex();
 
     static void formatString(string &str, unsigned tabend);
     static void formatString(string &str, unsigned tab1, unsigned tab2);
@@ -230,9 +295,28 @@ namespace parser {
 
     bool isKeyDefined(keyType key) const;
 
+    // Lookups without locking, for callers holding registryLock
+    bool findCmdLine(keyType key) const;
+    bool findInpFile(keyType key) const;
+    bool findOption(keyType key, parseMode mode) const;
+
+    template<class T>
+    bool findCmdLine(keyType key, T &value) const;
+    template<class T>
+    bool findInpFile(keyType key, T &value) const;
+    template<class T>
+    bool findOption(keyType key, T &value, parseMode mode) const;
+
+    const InputIndex::Entry *inputEntry(const InputIndex &index, keyType key) const;
+    bool inputFlag(const InputIndex &index, keyType key) const;
+
     template<typename T>
     static void convert(const string &str, T &x, bool failIfLeftoverChars = true);
 
+    // conversion of the characters [first,last) of a longer string
+    template<typename T>
+    static void convertRange(const char *first, const char *last, T &x);
+
     template<class T>
     void convert(const string &str, std::vector<T> &val) const;
 
@@ -270,24 +354,55 @@ namespace parser {
   template<>
   void Parser::convert(const string &str, double &value, bool failIfLeftoverChars);
 
+  template<>
+  void Parser::convert(const string &str, int &value, bool failIfLeftoverChars);
+
+  template<>
+  void Parser::convert(const string &str, long &value, bool failIfLeftoverChars);
+
+  template<class T>
+  void Parser::convertRange(const char *first, const char *last, T &x)
+  {
+    convert(string(first, last), x);
+  }
+
+  template<>
+  void Parser::convertRange(const char *first, const char *last, int &value);
+
+  template<>
+  void Parser::convertRange(const char *first, const char *last, long &value);
+
+  template<>
+  void Parser::convertRange(const char *first, const char *last, float &value);
+
+  template<>
+  void Parser::convertRange(const char *first, const char *last, double &value);
+
   template<class T>
   bool Parser::parseOption(keyType key, T &value, parseMode mode) const
+  {
+    ReadLock lock(registryLock.mutex);
+    return findOption(key, value, mode);
+  }
+
+  template<class T>
+  bool Parser::findOption(keyType key, T &value, parseMode mode) const
   {
     try {
 
       bool parsed = false;
       switch (mode) {
       case inpFile:
-        parsed = parseInpFile(key, value);
+        parsed = findInpFile(key, value);
         break;
       case cmdLine:
-        parsed = parseCmdLine(key, value);
+        parsed = findCmdLine(key, value);
         break;
       case inpFile_cmdLine:
-        parsed = parseInpFile(key, value) | parseCmdLine(key, value);
+        parsed = findInpFile(key, value) | findCmdLine(key, value);
         break;
       case cmdLine_inpFile:
-        parsed = parseCmdLine(key, value) | parseInpFile(key, value);
+        parsed = findCmdLine(key, value) | findInpFile(key, value);
         break;
       }
       return parsed;
@@ -315,73 +430,77 @@ namespace parser {
 
   template<class T>
   bool Parser::parseCmdLine(keyType key, T &value) const
+  {
+    ReadLock lock(registryLock.mutex);
+    return findCmdLine(key, value);
+  }
+
+  template<class T>
+  bool Parser::findCmdLine(keyType key, T &value) const
   {
     if (! isKeyDefined(key))
       return false;
 
-    ArgListConstIter A;
+    // the first argument matching any of the aliases and followed by a
+    // value
+    const string *found = 0;
+    int first = 0;
     OptionListConstIter O;
-    for (A=Args.begin(); A!=Args.end(); ++A) {
-      for (O=Options.find(key); O!=Options.upper_bound(key); ++O) {
-        if (*A == O->second && *A != Args.back()) {
-          convert(*(++A), value);
-          return true;
-        }
+    for (O=Options.find(key); O!=Options.upper_bound(key); ++O) {
+      const ArgIndex::Positions *P = ArgsIndex.find(O->second);
+      if (P && ArgsIndex.next(P->front()) && (! found || P->front() < first)) {
+        first = P->front();
+        found = ArgsIndex.next(first);
       }
     }
-    return false;
+    if (! found)
+      return false;
+    convert(*found, value);
+    return true;
   }
 
   template<class T>
   bool Parser::parseInpFile(keyType key, T &value) const
   {
-    using std::getline;
+    ReadLock lock(registryLock.mutex);
+    return findInpFile(key, value);
+  }
+
+  template<class T>
+  bool Parser::findInpFile(keyType key, T &value) const
+  {
     if (! isKeyDefined(key) || ! inputFileNameParsed)
       return false;
 
-    // there is no "nocreate" in StdC++ :(
-    // ios::in is default
-    ifstream fid(inputFileName.c_str());
-    if (! fid)
-      throw ParserException("Cannot open file '" + inputFileName + "'");
-
-    // automatic memory management, also doesn't overflow
-    string line;
-    OptionListConstIter O;
-    // fixes the usual eof() bug
-    while (getline(fid, line)) {
-      if (line[0]!='#' && line[0]!='%') {
-        for (O=Options.find(key); O!=Options.upper_bound(key); ++O) {
-          string opt1(O->second + "=");
-          string opt2(O->second + " ");
-          if (line.find(opt1) == 0 || line.find(opt2) == 0) {
-            line.erase(0, opt1.size());
-            convert(line, value);
-            fid.close();
-            return true;
-          }
-        }
-      }
-    }
-    // id is closed automatically no need for id.close();
-    return false;
+    const InputIndex::Entry *found = inputEntry(*inputIndex, key);
+    if (! found)
+      return false;
+    convert(found->value, value);
+    return true;
   }
 
   template<class T>
   bool Parser::parseOptions(keyType key, std::vector<T> &values) const
   {
+    ReadLock lock(registryLock.mutex);
     if ( !isKeyDefined(key) )
       return false;
 
-    ArgListConstIter A;
+    // the values following the aliases in command line order
+    ArgIndex::Positions positions;
     OptionListConstIter O;
-    for (A=Args.begin(); A!=Args.end(); ++A) {
-      for (O=Options.find(key); O!=Options.upper_bound(key); ++O) {
-        if (*A == O->second && *A != Args.back()) {
-          T value;
-          convert(*(++A), value);
-          values.push_back(value);
-        }
+    for (O=Options.find(key); O!=Options.upper_bound(key); ++O) {
+      const ArgIndex::Positions *P = ArgsIndex.find(O->second);
+      if (P)
+        positions.insert(positions.end(), P->begin(), P->end());
+    }
+    std::sort(positions.begin(), positions.end());
+    for (size_t i=0; i<positions.size(); ++i) {
+      const string *next = ArgsIndex.next(positions[i]);
+      if (next) {
+        T value;
+        convert(*next, value);
+        values.push_back(value);
       }
     }
     return (values.empty() ? false : true);
@@ -390,52 +509,43 @@ namespace parser {
   template<class T>
   void Parser::convert(const string &str, std::vector<T> &vec) const
   {
-
+    // elements converted in place, the vector sized once
+    const char *first = str.c_str(), *last = first+str.size();
     vec.clear();
-    string::size_type begin(0);
-    string::size_type end(str.npos);
-    while ( (end=str.find(',', begin)) != str.npos ) {
-      string sstr = str.substr(begin, end-begin);
+    vec.reserve(std::count(first, last, ',')+1);
+    for (const char *begin=first; ; ) {
+      const char *end = std::find(begin, last, ',');
       T value;
-      convert(sstr, value);
+      convertRange(begin, end, value);
       vec.push_back(value);
+      if (end == last)
+        break;
       begin = end+1;
     }
-    string sstr = str.substr(begin);
-    T value;
-    convert(sstr, value);
-    vec.push_back(value);
-
   }
 
 #ifdef BZ_TINYVEC_H
   template<class T, int N>
   void Parser::convert(const string &str, blitz::TinyVector<T,N> &vec) const
   {
-    string::size_type begin(0);
-    string::size_type end(str.npos);
-    if ( (end=str.find(',', begin)) == str.npos ) {
+    const char *first = str.c_str(), *last = first+str.size();
+    int n = std::count(first, last, ',')+1;
+    if (n == 1) {
       T value;
-      convert(str, value);
+      convertRange(first, last, value);
       vec = value;
-    } else {
-      int i = 0;
-      do {
-        string sstr = str.substr(begin, end-begin);
-        T value;
-        convert(sstr, value);
-        vec(i++) = value;
-        begin = end+1;
-      } while ( (end=str.find(',', begin)) != str.npos && i < N );
-      string sstr = str.substr(begin);
-      T value;
-      convert(sstr, value);
-      vec(i) = value;
-      if ( i != N-1 ) {
-        ostringstream os;
-        os << "Incorrect length for vector '" << str <<  "': " << i+1 << ", should be " << N << ".";
-        throw ParserException(os.str());
-      }
+      return;
+    }
+    if (n != N) {
+      ostringstream os;
+      os << "Incorrect length for vector '" << str <<  "': " << n << ", should be " << N << ".";
+      throw ParserException(os.str());
+    }
+    const char *begin = first;
+    for (int i=0; i<N; ++i) {
+      const char *end = std::find(begin, last, ',');
+      convertRange(begin, end, vec(i));
+      begin = end+1;
     }
   }
 #endif
@@ -444,28 +554,16 @@ namespace parser {
   template<class T>
   void Parser::convert(const string &str, blitz::Array<T,1> &vec) const
   {
-    string::size_type begin(0);
-    string::size_type end(str.npos);
-    if ( (end=str.find(',', begin)) == str.npos ) {
+    // one pass to count the elements, the array is resized once
+    const char *first = str.c_str(), *last = first+str.size();
+    vec.resize(std::count(first, last, ',')+1);
+    const char *begin = first;
+    for (int i=0; i<vec.extent(0); ++i) {
+      const char *end = std::find(begin, last, ',');
       T value;
-      convert(str, value);
-      vec.resize(1);
-      vec = value;
-    } else {
-      int i = 0;
-      do {
-        string sstr = str.substr(begin, end-begin);
-        T value;
-        convert(sstr, value);
-        vec.resizeAndPreserve(i+1);
-        vec(i++) = value;
-        begin = end+1;
-      } while ( (end=str.find(',', begin)) != str.npos );
-      string sstr = str.substr(begin);
-      T value;
-      convert(sstr, value);
-      vec.resizeAndPreserve(i+1);
+      convertRange(begin, end, value);
       vec(i) = value;
+      begin = end+1;
     }
   }
 
@@ -20,8 +20,11 @@
  *
  **************************************************************************/
 
+#include <cerrno>
 #include <cmath>
+#include <cstdlib>
 #include <cstring>
+#include <limits>
 
 #include <unistd.h>        // only needed for definition of gethostname
 #include <sys/param.h>     // only needed for definition of MAXHOSTNAMELEN
@@ -35,6 +38,62 @@ using std::getline;
 
 namespace parser {
 
+  namespace {
+
+    // strtol() conversion of the characters [first,last) to an integer of
+    // type T, which fails on a value out of range and on leftover
+    // characters if fail is set
+    template<typename T>
+    bool toInteger(const char *first, const char *last, T &x, bool fail)
+    {
+      char *end;
+      errno = 0;
+      long v = strtol(first, &end, 10);
+      if (end == first || end > last || errno == ERANGE ||
+          v < std::numeric_limits<T>::min() ||
+          v > std::numeric_limits<T>::max() || (fail && end != last))
+        return false;
+      x = static_cast<T>(v);
+      return true;
+    }
+
+    // strtod() conversion of the characters [first,last) to a real of type
+    // T, followed by an optional operator and operand as in 1/3, 2*pi or
+    // 10^-3, characters after are ignored
+    template<typename T>
+    bool toReal(const char *first, const char *last, T &x)
+    {
+      char *end;
+      double v = strtod(first, &end);
+      if (end == first || end > last || v != v ||
+          std::fabs(v) > std::numeric_limits<T>::max())
+        return false;
+      if (end < last) {
+        char c = *end, *end2;
+        double y = strtod(end+1, &end2);
+        if (end2 != end+1 && end2 <= last) {
+          switch (c) {
+          case '/':
+            v /= y;
+            break;
+          case '*':
+            v *= y;
+            break;
+          case '^':
+            v = pow(v, y);
+            break;
+          default:
+            std::string op(1, c);
+            throw  ParserException("Operator '" + op + "' not supported\n");
+          }
+        }
+      }
+      x = static_cast<T>(v);
+      return true;
+    }
+
+  }
+
   Parser::ValueDescPair v_mapInit[] = {
     Parser::ValueDescPair(types::none      ,         ""),
     Parser::ValueDescPair(types::boolean   ,     "bool"),
@@ -55,10 +114,11 @@ namespace parser {
   Parser::ValuesDescList Parser::TypeValues(v_mapInit, v_mapInitEnd);
 
   Parser::Parser(int nargs, char* args []) :
-    Cmd(), Args(0), Options(), Aliases(),
+    Cmd(), Args(0), ArgsIndex(), Options(), Aliases(), Slots(),
     className(), packageName(), numVersion(), copyrightText(), progName(),
-    prefixName(), debugParser(false), classDebugLevel(0), inputFileName(),
-    inputFileNameParsed(false)
+    prefixName(), debugParser(false), classDebugLevel(0), debugOptionName(),
+    inputFileName(), inputFileNameParsed(false), inputIndex(), inputWatched(false),
+    inputCallbacks(), registryLock()
   {
 
 #if defined(HAVE_MPI)
@@ -85,9 +145,11 @@ namespace parser {
         debugParser = true;
       }
     }
+    ArgsIndex.build(Args);
 
     if (debugParser) {
       viewArgs(cout);
+      OutputLock output(outputMutex());
       viewOptions(cout);
     }
 
@@ -107,9 +169,18 @@ namespace parser {
 
     inputFileNameParsed = parseOption("-i", inputFileName, cmdLine);
     if ((inputFileNameParsed = parseOption("-i", inputFileName, cmdLine))) {
-      ifstream fid(inputFileName.c_str());
-      if (! fid)
+      // read and indexed once, shared with the other parsers of the file
+      try {
+        inputIndex = InputIndex::load(inputFileName);
+      } catch (std::runtime_error &e) {
+        throw ParserException("Input file '" + inputFileName + "': " +
+                              e.what() + "\n");
+      }
+      if (! inputIndex)
         throw ParserException("Input file '" + inputFileName + "' not found\n");
+      // the slots registered so far did not see the file
+      WriteLock lock(registryLock.mutex);
+      updateSlots();
     }
 
   }
@@ -117,13 +188,41 @@ namespace parser {
   Parser::~Parser()
   {}
 
+  void Parser::broadcastInputFile(int nargs, char* args [])
+  {
+    // arguments split at '=' as in the constructor
+    std::vector<string> list;
+    for (int i=1; i<nargs; ++i) {
+      string str(args[i]);
+      stringSizeType pos = str.find('=');
+      if (pos == string::npos || pos == str.length()-1) {
+        list.push_back(str);
+      } else {
+        list.push_back(str.substr(0, pos));
+        list.push_back(str.substr(pos+1));
+      }
+    }
+    for (size_t i=0; i+1<list.size(); ++i) {
+      if (list[i] == "-i" || list[i] == "--input") {
+        try {
+          InputIndex::broadcast(list[i+1]);
+        } catch (std::runtime_error &e) {
+          throw ParserException("Input file '" + list[i+1] + "': " +
+                                e.what() + "\n");
+        }
+        return;
+      }
+    }
+  }
+
   void Parser::printCmd(std::ostream &os) const
   {
     time_t rawtime;
-    struct tm *timeinfo;
+    struct tm timeinfo;
+    char date[32];
     time(&rawtime);
-    timeinfo = localtime(&rawtime);
-    os << "date        : " << asctime(timeinfo);
+    localtime_r(&rawtime, &timeinfo);
+    os << "date        : " << asctime_r(&timeinfo, date);
 
 
     char hostname[MAXHOSTNAMELEN];
@@ -144,6 +243,7 @@ namespace parser {
 
   void Parser::viewArgs(std::ostream &os) const
   {
+    OutputLock output(outputMutex());
     cout
         << "*****************" << endl
         << "Passed arguments:" << endl;
@@ -156,17 +256,20 @@ namespace parser {
 
   void Parser::registerClass(const string &name)
   {
+    WriteLock lock(registryLock.mutex);
     className = name;
   }
 
   void Parser::registerProgram(const string &name)
   {
+    WriteLock lock(registryLock.mutex);
     progName = name;
   }
 
   void Parser::registerPackage(const string &package, const string &version,
                                const string &copyright)
   {
+    WriteLock lock(registryLock.mutex);
     packageName   = package;
     numVersion    = version;
     copyrightText = copyright;
@@ -174,18 +277,39 @@ namespace parser {
 
   void Parser::setPrefix(const string &name)
   {
+    WriteLock lock(registryLock.mutex);
     prefixName = name;
   }
 
   void Parser::insertOption(const string &opt, valueType type,
                             const string &desc, const Any &defval)
   {
+    insertSlot(opt, type, desc, defval);
+  }
+
+  // The slot of an option inserted again with the same type when typed,
+  // -1 otherwise
+  int Parser::insertSlot(const string &opt, valueType type,
+                         const string &desc, const Any &defval, bool typed)
+  {
+    WriteLock lock(registryLock.mutex);
     if (debugParser) {
+      OutputLock output(outputMutex());
       cerr << "insertOption(" << opt << ","
            << type << "," << desc << ")" << endl;
       viewOptions(cerr);
     }
-    if ( Options.find(opt) != Options.end() ) {
+    OptionIter O(Options.find(prefixName+opt));
+    if (typed && O != Options.end()) {
+      if (O->second.type != type)
+        throw ParserException("Option (" + prefixName + opt + "," +
+                              TypeValues.find(type)->second +
+                              ") already exists as (" + O->first + "," +
+                              TypeValues.find(O->second.type)->second + ")\n");
+      return O->second.slot;
+    }
+    if ( O != Options.end() ) {
+      OutputLock output(outputMutex());
       cerr << "*** Warning : " <<
            "option (" << opt << "," << TypeValues.find(type)->second << ")";
       if (! className.empty())
@@ -194,21 +318,28 @@ namespace parser {
         cerr << " in program '" << progName << "'";
       cerr << " alread exists\nSkipping insertion of option "
            << "(" << opt << ")" << endl;
-      return;
+      return -1;
     }
 
-    Options.insert(OptionPair(string(prefixName+opt), Option(type,desc,defval)));
+    int slot = static_cast<int>(Slots.size());
+    Slots.push_back(Slot(prefixName+opt));
+    Options.insert(OptionPair(string(prefixName+opt), Option(type,desc,defval,slot)));
     Aliases.insert(AliasPair(string(prefixName+opt),string(prefixName+opt)));
+    updateSlot(Slots.back());
+    return slot;
   }
 
 
   void Parser::insertOptionAlias(const string &opt, const string &alias)
   {
+    WriteLock lock(registryLock.mutex);
     if (debugParser) {
+      OutputLock output(outputMutex());
       cerr << "insertOptionAlias(" << opt << "," << alias << ")" << endl;
       viewOptions(cerr);
     }
     if ( Options.find(opt) == Options.end() ) {
+      OutputLock output(outputMutex());
       cerr << "*** Warning : option " << opt;
       if (! className.empty())
         cerr << " in class '" << className << "'";
@@ -220,21 +351,112 @@ namespace parser {
     }
 
     Aliases.insert(AliasPair(string(prefixName+opt),string(alias)));
+    OptionIter O(Options.find(prefixName+opt));
+    if (O != Options.end())
+      updateSlot(Slots[O->second.slot]);
   }
 
 
   void Parser::parseLevelDebugOption(const string &name)
   {
-    insertOption(name, types::integer, "Level of debug information", Any(classDebugLevel));
-    parseOption(name, classDebugLevel);
+    int level = debugLevel();
+    insertOption(name, types::integer, "Level of debug information", Any(level));
+    parseOption(name, level);
+    WriteLock lock(registryLock.mutex);
+    classDebugLevel = level;
+    debugOptionName = name;
   }
 
   int Parser::debugLevel() const
   {
+    ReadLock lock(registryLock.mutex);
     return classDebugLevel;
   }
 
+  void Parser::watchInputFile(double interval)
+  {
+    WriteLock lock(registryLock.mutex);
+    if (! inputFileNameParsed)
+      return;
+    // shared with the other parsers of the file
+    try {
+      InputIndex::watch(inputFileName, interval);
+    } catch (std::runtime_error &e) {
+      throw ParserException("Input file '" + inputFileName + "': " +
+                            e.what() + "\n");
+    }
+    inputWatched = true;
+  }
 
+  void Parser::onInputChange(const string &opt, const std::function<void()> &callback)
+  {
+    WriteLock lock(registryLock.mutex);
+    if (isKeyDefined(opt))
+      inputCallbacks.push_back(CallbackList::value_type(opt, callback));
+  }
+
+  bool Parser::reloadInputFile()
+  {
+    {
+      ReadLock lock(registryLock.mutex);
+      if (! inputWatched)
+        return false;
+    }
+    // collective in broadcast mode, so out of the lock of the parser
+    InputIndex::Ptr fresh;
+    try {
+      fresh = InputIndex::update(inputFileName);
+    } catch (std::runtime_error &e) {
+      OutputLock output(outputMutex());
+      cerr << "*** Warning: " << e.what()
+           << "\tKeeping previous values..." << endl;
+      return false;
+    }
+
+    // the callbacks are called once the lock is released, they may parse
+    // options again
+    std::vector<std::function<void()> > calls;
+    {
+      WriteLock lock(registryLock.mutex);
+      // read again by this parser or by another one of the file
+      if (! fresh || fresh == inputIndex)
+        return false;
+
+      InputIndex::Ptr previous(inputIndex);
+      inputIndex = fresh;
+      // the slots point into the previous index
+      updateSlots();
+
+      if (! debugOptionName.empty()) {
+        try {
+          findOption(debugOptionName, classDebugLevel, inpFile_cmdLine);
+        } catch (ParserException &e) {
+          OutputLock output(outputMutex());
+          cerr << "*** Warning: " << e.what() << endl;
+        }
+      }
+      for (CallbackList::const_iterator c=inputCallbacks.begin();
+           c!=inputCallbacks.end(); ++c) {
+        const InputIndex::Entry *a = inputEntry(*previous, c->first);
+        const InputIndex::Entry *b = inputEntry(*inputIndex, c->first);
+        if ((a == 0) != (b == 0) || (a && a->value != b->value) ||
+            inputFlag(*previous, c->first) != inputFlag(*inputIndex, c->first))
+          calls.push_back(c->second);
+      }
+    }
+    for (size_t i=0; i<calls.size(); ++i)
+      calls[i]();
+    return true;
+  }
+
+
+  std::mutex &Parser::outputMutex()
+  {
+    static std::mutex m;
+    return m;
+  }
+
+  // The caller holds outputMutex(), the warning is part of its output
   void Parser::formatString(string &str, unsigned t)
   {
     if ( str.size() < t ) {
@@ -324,7 +546,9 @@ namespace parser {
 
   bool Parser::parseHelp() const
   {
-    if (parseOption("-h", cmdLine)) {
+    ReadLock lock(registryLock.mutex);
+    if (findOption("-h", cmdLine)) {
+      OutputLock output(outputMutex());
       if (! className.empty()) {
         cerr << "Registered options for class '" << className <<"':\n" << endl;
       } else if (! progName.empty()) {
@@ -340,7 +564,9 @@ namespace parser {
 
   bool Parser::parseVersion() const
   {
-    if (parseOption("-v", cmdLine)) {
+    ReadLock lock(registryLock.mutex);
+    if (findOption("-v", cmdLine)) {
+      OutputLock output(outputMutex());
       if (! packageName.empty()) {
         if (! className.empty()) {
           cerr << "Class '" << className << "'";
@@ -359,11 +585,14 @@ namespace parser {
 
   bool Parser::parseTemplate() const
   {
-    if (parseOption("-t", cmdLine)) {
+    ReadLock lock(registryLock.mutex);
+    if (findOption("-t", cmdLine)) {
+      OutputLock output(outputMutex());
       if (! progName.empty()) {
         string header("\n## Automatically generated template setup file");
         const time_t now(time(0));
-        string str_now(ctime(&now));
+        char date[32];
+        string str_now(ctime_r(&now, date));
         str_now.erase(str_now.size()-1);
         header += "\n## Date              : " + str_now;
         string hashes(last_tab,'#');
@@ -400,59 +629,58 @@ namespace parser {
   }
 
   bool Parser::parseCmdLine(const string &opt) const
+  {
+    ReadLock lock(registryLock.mutex);
+    return findCmdLine(opt);
+  }
+
+  bool Parser::parseInpFile(const string &opt) const
+  {
+    ReadLock lock(registryLock.mutex);
+    return findInpFile(opt);
+  }
+
+  bool Parser::parseOption(const string &opt, parseMode mode) const
+  {
+    ReadLock lock(registryLock.mutex);
+    return findOption(opt, mode);
+  }
+
+  bool Parser::findCmdLine(const string &opt) const
   {
     if (! isKeyDefined(opt))
       return false;
 
-    for (ArgListConstIter A(Args.begin()); A!=Args.end(); ++A)
-      for (AliasIter O(Aliases.find(opt)); O!=Aliases.upper_bound(opt); ++O)
-        if (*A == O->second)
-          return true;
-
-    return false;
+    const Slot *s = resolve(opt);
+    return s && s->cmdFlag;
   }
 
-  bool Parser::parseInpFile(const string &opt) const
+  bool Parser::findInpFile(const string &opt) const
   {
     if (! isKeyDefined(opt) || ! inputFileNameParsed)
       return false;
 
-    // there is no "nocreate" in StdC++ :(
-    // ios::in is default
-    ifstream fid(inputFileName.c_str());
-    if (! fid)
-      throw ParserException("Cannot open file '" + inputFileName + "'\n");
-
-    // automatic memory management, also doesn't overflow
-    string line;
-    // fixes the usual eof() bug
-    while (getline(fid, line)) {
-      if (line[0]!='#' && line[0]!='%' && (line[0]!='/' && line[0]!='/')) {
-        for (AliasIter O(Aliases.find(opt)); O!=Aliases.upper_bound(opt); ++O)
-          if (line == O->second)
-            return true;
-      }
-    }
-    return false;
+    const Slot *s = resolve(opt);
+    return s && s->inpFlag;
   }
 
-  bool Parser::parseOption(const string &opt, parseMode mode) const
+  bool Parser::findOption(const string &opt, parseMode mode) const
   {
     try {
 
       bool parsed = false;
       switch (mode) {
       case inpFile:
-        parsed = parseInpFile(opt);
+        parsed = findInpFile(opt);
         break;
       case cmdLine:
-        parsed = parseCmdLine(opt);
+        parsed = findCmdLine(opt);
         break;
       case inpFile_cmdLine:
-        parsed = parseInpFile(opt) | parseCmdLine(opt);
+        parsed = findInpFile(opt) | findCmdLine(opt);
         break;
       case cmdLine_inpFile:
-        parsed = parseCmdLine(opt) | parseInpFile(opt);
+        parsed = findCmdLine(opt) | findInpFile(opt);
         break;
       }
       return parsed;
@@ -470,6 +698,7 @@ namespace parser {
 
   void Parser::checkMap(const string &opt, const LUT &map, int value) const
   {
+    ReadLock lock(registryLock.mutex);
     if (! isKeyDefined(opt))
       return;
 
@@ -490,6 +719,7 @@ namespace parser {
   bool Parser::isKeyDefined(const string &opt) const
   {
     if (Aliases.find(opt) == Aliases.end()) {
+      OutputLock output(outputMutex());
       cerr << "*** Warning: Undefined option '" << opt
            << "'\tSkipping..." << endl;
       return false;
@@ -497,6 +727,75 @@ namespace parser {
     return true;
   }
 
+  const Parser::Slot &Parser::resolve(const Parser *owner, int slot) const
+  {
+    if (owner != this || slot < 0 || slot >= static_cast<int>(Slots.size()))
+      throw ParserException("Option handle of another parser\n");
+    return Slots[slot];
+  }
+
+  void Parser::updateSlot(Slot &s)
+  {
+    s.cmdFlag = s.inpFlag = false;
+    s.cmdValue = -1;
+    s.inpValue = 0;
+    for (AliasIter O(Aliases.find(s.name)); O!=Aliases.upper_bound(s.name); ++O) {
+      const ArgIndex::Positions *P = ArgsIndex.find(O->second);
+      if (P) {
+        s.cmdFlag = true;
+        // the first alias found in the arguments and followed by a value
+        if (s.cmdValue < 0 && ArgsIndex.next(P->front()))
+          s.cmdValue = P->front();
+      }
+    }
+    if (inputIndex) {
+      s.inpValue = inputEntry(*inputIndex, s.name);
+      s.inpFlag = inputFlag(*inputIndex, s.name);
+    }
+  }
+
+  void Parser::updateSlots()
+  {
+    for (size_t i=0; i<Slots.size(); ++i)
+      updateSlot(Slots[i]);
+  }
+
+  const InputIndex::Entry *Parser::inputEntry(const InputIndex &index,
+                                              const string &opt) const
+  {
+    // the first line of the file setting any of the aliases
+    const InputIndex::Entry *found = 0;
+    for (AliasIter O(Aliases.find(opt)); O!=Aliases.upper_bound(opt); ++O) {
+      const InputIndex::Entry *e = index.value(O->second);
+      if (e && (! found || e->line < found->line))
+        found = e;
+    }
+    return found;
+  }
+
+  bool Parser::inputFlag(const InputIndex &index, const string &opt) const
+  {
+    for (AliasIter O(Aliases.find(opt)); O!=Aliases.upper_bound(opt); ++O)
+      if (index.flag(O->second))
+        return true;
+    return false;
+  }
+
+  const Parser::Slot *Parser::resolve(const string &opt) const
+  {
+    OptionIter O(Options.find(opt));
+    return O == Options.end() ? 0 : &Slots[O->second.slot];
+  }
+
+  Parser::string Parser::aliasList(const Slot &s) const
+  {
+    AliasIter O(Aliases.find(s.name));
+    string list(O->second);
+    for (++O; O!=Aliases.upper_bound(s.name); ++O)
+      list += ", " + O->second;
+    return list;
+  }
+
   template<>
   void Parser::convert(const string &str, bool &value, bool failIfLeftoverChars)
   {
@@ -524,61 +823,59 @@ namespace parser {
   template<>
   void Parser::convert(const string &str, float &value, bool failIfLeftoverChars)
   {
-    istringstream is(str);
-    char c;
-    float x;
-
-    if (!(is >> x)) {
+    if (! toReal(str.c_str(), str.c_str()+str.size(), value))
       throw  BadConversion(str);
-    } else {
-      value = x;
-      if (is.get(c) && is >> x) {
-        switch (c) {
-        case '/':
-          value /= x;
-          break;
-        case '*':
-          value *= x;
-          break;
-        case '^':
-          value = powf(value, x);
-          break;
-        default:
-          string op(1, c);
-          throw  ParserException("Operator '" + op + "' not supported\n");
-        }
-      }
-    }
   }
 
   template<>
   void Parser::convert(const string &str, double &value, bool failIfLeftoverChars)
   {
-    istringstream is(str);
-    char c;
-    float x;
+    if (! toReal(str.c_str(), str.c_str()+str.size(), value))
+      throw  BadConversion(str);
+  }
+
+  template<>
+  void Parser::convert(const string &str, int &value, bool failIfLeftoverChars)
+  {
+    if (! toInteger(str.c_str(), str.c_str()+str.size(), value,
+                    failIfLeftoverChars))
+      throw  BadConversion(str);
+  }
 
-    if (!(is >> x)) {
+  template<>
+  void Parser::convert(const string &str, long &value, bool failIfLeftoverChars)
+  {
+    if (! toInteger(str.c_str(), str.c_str()+str.size(), value,
+                    failIfLeftoverChars))
       throw  BadConversion(str);
-    } else {
-      value = x;
-      if (is.get(c) && is >> x) {
-        switch (c) {
-        case '/':
-          value /= x;
-          break;
-        case '*':
-          value *= x;
-          break;
-        case '^':
-          value = pow(value, x);
-          break;
-        default:
-          string op(1, c);
-          throw  ParserException("Operator '" + op + "' not supported\n");
-        }
-      }
-    }
+  }
+
+  template<>
+  void Parser::convertRange(const char *first, const char *last, int &value)
+  {
+    if (! toInteger(first, last, value, true))
+      throw  BadConversion(string(first, last));
+  }
+
+  template<>
+  void Parser::convertRange(const char *first, const char *last, long &value)
+  {
+    if (! toInteger(first, last, value, true))
+      throw  BadConversion(string(first, last));
+  }
+
+  template<>
+  void Parser::convertRange(const char *first, const char *last, float &value)
+  {
+    if (! toReal(first, last, value))
+      throw  BadConversion(string(first, last));
+  }
+
+  template<>
+  void Parser::convertRange(const char *first, const char *last, double &value)
+  {
+    if (! toReal(first, last, value))
+      throw  BadConversion(string(first, last));
   }
 
 
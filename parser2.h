@@ -25,16 +25,22 @@
 
 #include <list>
 #include <map>
+#include <mutex>
 #include <set>
 #include <vector>
 #include <algorithm>
+#include <functional>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <string>
 #include <stdexcept>
+#if __cplusplus >= 201402L
+#include <shared_mutex>
+#endif
 
 #include <any.h>
+#include <parser-index.h>
 
 #if defined(HAVE_MPI)
 #include <mpi.h>
@@ -92,9 +98,55 @@ namespace parser {
     const static int intVect    = 8;
     const static int realVect   = 9;
     const static int stringVect = 10;
+
+    // Type code of the options of type T_type inserted with a handle
+    template<typename T_type> struct code;
+
+    template<> struct code<bool> { static const int value = boolean; };
+    template<> struct code<char> { static const int value = character; };
+    template<> struct code<int> { static const int value = integer; };
+    template<> struct code<long> { static const int value = integer; };
+    template<> struct code<float> { static const int value = real; };
+    template<> struct code<double> { static const int value = real; };
+    template<> struct code<std::string> { static const int value = charStr; };
+    template<> struct code<char*> { static const int value = charStr; };
+    template<> struct code<std::vector<bool> > { static const int value = boolVect; };
+    template<> struct code<std::vector<char> > { static const int value = charVect; };
+    template<> struct code<std::vector<int> > { static const int value = intVect; };
+    template<> struct code<std::vector<float> > { static const int value = realVect; };
+    template<> struct code<std::vector<double> > { static const int value = realVect; };
+    template<> struct code<std::vector<std::string> > { static const int value = stringVect; };
+#ifdef BZ_TINYVEC_H
+    template<int N> struct code<blitz::TinyVector<int,N> > { static const int value = intVect; };
+    template<int N> struct code<blitz::TinyVector<float,N> > { static const int value = realVect; };
+    template<int N> struct code<blitz::TinyVector<double,N> > { static const int value = realVect; };
+#endif
   }
 
 
+  class Parser;
+
+  // Option of type T_type returned by the typed Parser::insertOption(),
+  // parsed by index into the registry of the parser that returned it
+  // instead of a search by name. Parsing it with another parser throws
+  // ParserException.
+  template<typename T_type>
+  class OptionHandle {
+  public:
+    OptionHandle() : owner(0), slot(-1)
+    {}
+    bool valid() const {
+      return slot >= 0;
+    }
+  private:
+    friend class Parser;
+    OptionHandle(const Parser *o, int s) : owner(o), slot(s)
+    {}
+    const Parser *owner;
+    int slot;
+  };
+
+
   class Parser {
   public:
     enum tabulator { tab1=30, tab2=45, tab3=80, last_tab=tab3 };
@@ -122,7 +174,8 @@ namespace parser {
       valueType type;
       string description;
       Any value;
-      Option(valueType t, const string &d, const Any &v) : type(t), description(d), value(v)
+      int slot;
+      Option(valueType t, const string &d, const Any &v, int s) : type(t), description(d), value(v), slot(s)
       {}
     };
 
@@ -144,6 +197,12 @@ namespace parser {
     explicit Parser(int nargs=0, char* args []=0);
     virtual ~Parser();
 
+    // With InputIndex::setBroadcast(true), the input file of the -i/--input
+    // argument read by rank 0 and sent to the other ranks, to be called by
+    // all the ranks before constructing the Parser objects, which then do
+    // not communicate. Collective, see InputIndex::broadcast().
+    static void broadcastInputFile(int nargs, char* args []);
+
     void printCmd(std::ostream &os) const;
     void viewArgs(std::ostream &os) const;
 
@@ -157,9 +216,20 @@ namespace parser {
     void insertOption(const string &opt, valueType type, const string &desc, const Any &defval);
     void insertOptionAlias(const string &opt, const string &alias);
 
+    // Inserting again an option of the same type returns the handle of
+    // the option inserted first, of another type throws ParserException
+    template<typename T_type>
+    OptionHandle<T_type> insertOption(const string &opt, const string &desc, const T_type &defval);
+    template<typename T_type>
+    OptionHandle<T_type> insertOption(const string &opt, const string &desc);
+
     void parseLevelDebugOption(const string &name);
     int debugLevel() const;
 
+    // The lookups, from here to the parseOption() of handles, can be
+    // called concurrently from several threads. Registration and
+    // reloadInputFile() hold the lock of the parser exclusively and the
+    // diagnostics are written whole.
     virtual bool parseHelp() const;
     virtual bool parseVersion() const;
     virtual bool parseTemplate() const;
@@ -183,6 +253,31 @@ namespace parser {
     template<typename T_type>
     bool parseOptions(const string &opt, std::vector<T_type> &value) const;
 
+    template<typename T_type>
+    bool parseOption(const OptionHandle<T_type> &opt, parseMode mode=inpFile_cmdLine) const;
+
+    template<typename T_type>
+    bool parseOption(const OptionHandle<T_type> &opt, T_type &value, parseMode mode=inpFile_cmdLine) const;
+
+    template<typename T_type, typename Test>
+    bool parseOption(const OptionHandle<T_type> &opt, T_type &value, parseMode mode=inpFile_cmdLine) const;
+
+    // Live reload of the input file, opted in with watchInputFile() and
+    // done where the program calls reloadInputFile(), at a point where the
+    // options can safely change. The debug level option is parsed again
+    // and the callbacks of the options whose value or flag has changed in
+    // the file are called. The file is watched once and read again once
+    // per change whatever the number of parsers reading it. With HAVE_MPI
+    // and several ranks watchInputFile() requires the broadcast mode,
+    // InputIndex::setBroadcast(true) and broadcastInputFile(), and
+    // reloadInputFile() is collective and follows the changes seen by
+    // rank 0. reloadInputFile() is to be called from a single thread, on
+    // all the ranks in the same order, while the other threads may go on
+    // with the lookups.
+    void watchInputFile(double interval=1.0);
+    void onInputChange(const string &opt, const std::function<void()> &callback);
+    bool reloadInputFile();
+
   protected:
 
 #if defined(HAVE_MPI)
@@ -201,10 +296,27 @@ namespace parser {
 
   private:
 
+    // Option of the registry with the lookups of its aliases in the
+    // command line and in the input file, made again by registration when
+    // aliases or the input file change so that the lookups only read them
+    struct Slot {
+      string name;
+      bool cmdFlag;
+      int cmdValue;       // position of the first alias followed by a value
+      bool inpFlag;
+      const InputIndex::Entry *inpValue;
+      explicit Slot(const string &n) : name(n), cmdFlag(false),
+        cmdValue(-1), inpFlag(false), inpValue(0)
+      {}
+    };
+    typedef std::vector<Slot> SlotList;
+
     string Cmd;
     ArgList Args;
+    ArgIndex ArgsIndex;
     OptionList Options;
     AliasList Aliases;
+    SlotList Slots;
 
     static ValuesDescList TypeValues;
 
@@ -217,9 +329,42 @@ namespace parser {
 
     bool debugParser;
     int classDebugLevel;
+    string debugOptionName;
 
     string inputFileName;
     bool inputFileNameParsed;
+    InputIndex::Ptr inputIndex;
+
+    typedef std::vector<std::pair<string, std::function<void()> > > CallbackList;
+
+    bool inputWatched;
+    CallbackList inputCallbacks;
+
+    // Shared by the lookups, exclusive for registration. Before C++14
+    // there is no shared mutex and the lookups are serialized.
+#if __cplusplus >= 201402L
+    typedef std::shared_timed_mutex RegistryMutex;
+    typedef std::shared_lock<RegistryMutex> ReadLock;
+#else
+    typedef std::mutex RegistryMutex;
+    typedef std::lock_guard<RegistryMutex> ReadLock;
+#endif
+    typedef std::lock_guard<RegistryMutex> WriteLock;
+    typedef std::lock_guard<std::mutex> OutputLock;
+
+    // A copy of the parser gets a mutex of its own
+    struct Lock {
+      mutable RegistryMutex mutex;
+      Lock() : mutex() {}
+      Lock(const Lock &) : mutex() {}
+      Lock &operator=(const Lock &) {
+        return *this;
+      }
+    };
+    Lock registryLock;
+
+    // Serializes the writes to cout and cerr of all the parsers
+    static std::mutex &outputMutex();
 
     static void formatString(string &str, unsigned tabend);
     static void formatString(string &str, unsigned tab1, unsigned tab2);
@@ -229,9 +374,46 @@ namespace parser {
 
     bool isKeyDefined(const string &opt) const;
 
+    int insertSlot(const string &opt, valueType type, const string &desc, const Any &defval,
+                   bool typed=false);
+    void updateSlot(Slot &s);
+    void updateSlots();
+    const Slot &resolve(const Parser *owner, int slot) const;
+    const Slot *resolve(const string &opt) const;
+    string aliasList(const Slot &s) const;
+
+    // Lookups without locking, for callers holding registryLock
+    bool findCmdLine(const string &opt) const;
+    bool findInpFile(const string &opt) const;
+    bool findOption(const string &opt, parseMode mode) const;
+
+    template<typename T_type>
+    bool findCmdLine(const string &opt, T_type &value) const;
+    template<typename T_type>
+    bool findInpFile(const string &opt, T_type &value) const;
+    template<typename T_type>
+    bool findOption(const string &opt, T_type &value, parseMode mode) const;
+
+    template<typename T_type>
+    bool findOption(const OptionHandle<T_type> &opt, parseMode mode) const;
+    template<typename T_type>
+    bool findOption(const OptionHandle<T_type> &opt, T_type &value, parseMode mode) const;
+
+    const InputIndex::Entry *inputEntry(const InputIndex &index, const string &opt) const;
+    bool inputFlag(const InputIndex &index, const string &opt) const;
+
+    template<typename T_type>
+    bool parseCmdLine(const Slot &s, T_type &value) const;
+    template<typename T_type>
+    bool parseInpFile(const Slot &s, T_type &value) const;
+
     template<typename T_type>
     static void convert(const string &str, T_type &x, bool failIfLeftoverChars = true);
 
+    // conversion of the characters [first,last) of a longer string
+    template<typename T_type>
+    static void convertRange(const char *first, const char *last, T_type &x);
+
     template<typename T_type>
     void convert(const string &str, std::vector<T_type> &val) const;
 
@@ -269,24 +451,55 @@ namespace parser {
   template<>
   void Parser::convert(const string &str, double &value, bool failIfLeftoverChars);
 
+  template<>
+  void Parser::convert(const string &str, int &value, bool failIfLeftoverChars);
+
+  template<>
+  void Parser::convert(const string &str, long &value, bool failIfLeftoverChars);
+
+  template<typename T_type>
+  void Parser::convertRange(const char *first, const char *last, T_type &x)
+  {
+    convert(string(first, last), x);
+  }
+
+  template<>
+  void Parser::convertRange(const char *first, const char *last, int &value);
+
+  template<>
+  void Parser::convertRange(const char *first, const char *last, long &value);
+
+  template<>
+  void Parser::convertRange(const char *first, const char *last, float &value);
+
+  template<>
+  void Parser::convertRange(const char *first, const char *last, double &value);
+
   template<typename T_type>
   bool Parser::parseOption(const string &opt, T_type &value, parseMode mode) const
+  {
+    ReadLock lock(registryLock.mutex);
+    return findOption(opt, value, mode);
+  }
+
+  template<typename T_type>
+  bool Parser::findOption(const string &opt, T_type &value, parseMode mode) const
   {
     try {
 
       bool parsed = false;
       switch (mode) {
       case inpFile:
-        parsed = parseInpFile(opt, value);
+        parsed = findInpFile(opt, value);
         break;
       case cmdLine:
-        parsed = parseCmdLine(opt, value);
+        parsed = findCmdLine(opt, value);
         break;
       case inpFile_cmdLine:
-        parsed = parseInpFile(opt, value) | parseCmdLine(opt, value);
+        parsed = findInpFile(opt, value) | findCmdLine(opt, value);
         break;
       case cmdLine_inpFile:
-        parsed = parseCmdLine(opt, value) | parseInpFile(opt, value);
+        parsed = findCmdLine(opt, value) | findInpFile(opt, value);
         break;
       }
       return parsed;
@@ -306,8 +519,9 @@ namespace parser {
   template<typename T_type, typename Test>
   bool Parser::parseOption(const string &opt, T_type &value, parseMode mode) const
   {
+    ReadLock lock(registryLock.mutex);
     try {
-      bool parsed = parseOption<T_type>(opt, value, mode);
+      bool parsed = findOption(opt, value, mode);
       if (parsed) {
         Test test(value);
         test.run();
@@ -337,70 +551,173 @@ namespace parser {
 
   template<typename T_type>
   bool Parser::parseCmdLine(const string &opt, T_type &value) const
+  {
+    ReadLock lock(registryLock.mutex);
+    return findCmdLine(opt, value);
+  }
+
+  template<typename T_type>
+  bool Parser::parseInpFile(const string &opt, T_type &value) const
+  {
+    ReadLock lock(registryLock.mutex);
+    return findInpFile(opt, value);
+  }
+
+  template<typename T_type>
+  bool Parser::findCmdLine(const string &opt, T_type &value) const
   {
     if (! isKeyDefined(opt))
       return false;
+    const Slot *s = resolve(opt);
+    return s && parseCmdLine(*s, value);
+  }
 
-//    for (ArgListIter A=Args.begin(); A!=Args.end(); ++A) {
-    for (AliasIter O=Aliases.find(opt); O!=Aliases.upper_bound(opt); ++O) {
-      ArgListConstIter A = std::find(Args.begin(), Args.end(), O->second);
-      if (A != Args.end() && *A !=  Args.back()) {
-//        if (*A == O->second && *A != Args.back()) {
-        convert(*(++A), value);
-        return true;
-      }
+  template<typename T_type>
+  bool Parser::findInpFile(const string &opt, T_type &value) const
+  {
+    if (! isKeyDefined(opt))
+      return false;
+    const Slot *s = resolve(opt);
+    return s && parseInpFile(*s, value);
+  }
+
+  template<typename T_type>
+  bool Parser::parseCmdLine(const Slot &s, T_type &value) const
+  {
+    if (s.cmdValue < 0)
+      return false;
+    convert(*ArgsIndex.next(s.cmdValue), value);
+    return true;
+  }
+
+  template<typename T_type>
+  bool Parser::parseInpFile(const Slot &s, T_type &value) const
+  {
+    if (! inputFileNameParsed || ! s.inpValue)
+      return false;
+    convert(s.inpValue->value, value);
+    return true;
+  }
+
+  template<typename T_type>
+  OptionHandle<T_type> Parser::insertOption(const string &opt, const string &desc, const T_type &defval)
+  {
+    return OptionHandle<T_type>(this, insertSlot(opt, types::code<T_type>::value, desc,
+                                                 Any(defval), true));
+  }
+
+  template<typename T_type>
+  OptionHandle<T_type> Parser::insertOption(const string &opt, const string &desc)
+  {
+    return OptionHandle<T_type>(this, insertSlot(opt, types::code<T_type>::value, desc,
+                                                 Any(), true));
+  }
+
+  template<typename T_type>
+  bool Parser::parseOption(const OptionHandle<T_type> &opt, parseMode mode) const
+  {
+    ReadLock lock(registryLock.mutex);
+    return findOption(opt, mode);
+  }
+
+  template<typename T_type>
+  bool Parser::parseOption(const OptionHandle<T_type> &opt, T_type &value, parseMode mode) const
+  {
+    ReadLock lock(registryLock.mutex);
+    return findOption(opt, value, mode);
+  }
+
+  template<typename T_type>
+  bool Parser::findOption(const OptionHandle<T_type> &opt, parseMode mode) const
+  {
+    if (! opt.valid())
+      return false;
+
+    const Slot &s = resolve(opt.owner, opt.slot);
+    bool inp = inputFileNameParsed && s.inpFlag;
+    switch (mode) {
+    case inpFile:
+      return inp;
+    case cmdLine:
+      return s.cmdFlag;
+    default:
+      return inp || s.cmdFlag;
     }
-//    }
-    return false;
   }
 
   template<typename T_type>
-  bool Parser::parseInpFile(const string &opt, T_type &value) const
+  bool Parser::findOption(const OptionHandle<T_type> &opt, T_type &value, parseMode mode) const
   {
-    using std::getline;
-    if (! isKeyDefined(opt) || ! inputFileNameParsed)
+    if (! opt.valid())
       return false;
 
-    // there is no "nocreate" in StdC++ :(
-    // ios::in is default
-    ifstream fid(inputFileName.c_str());
-    if (! fid)
-      throw ParserException("Cannot open file '" + inputFileName + "'");
-
-    // automatic memory management, also doesn't overflow
-    string line;
-    // fixes the usual eof() bug
-    while (getline(fid, line)) {
-      if (line[0]!='#' && line[0]!='%') {
-        for (AliasIter O(Aliases.find(opt)); O!=Aliases.upper_bound(opt); ++O) {
-          string opt1(O->second + "=");
-          string opt2(O->second + " ");
-          if (line.find(opt1) == 0 || line.find(opt2) == 0) {
-            line.erase(0, opt1.size());
-            convert(line, value);
-            fid.close();
-            return true;
-          }
-        }
+    const Slot &s = resolve(opt.owner, opt.slot);
+    try {
+
+      bool parsed = false;
+      switch (mode) {
+      case inpFile:
+        parsed = parseInpFile(s, value);
+        break;
+      case cmdLine:
+        parsed = parseCmdLine(s, value);
+        break;
+      case inpFile_cmdLine:
+        parsed = parseInpFile(s, value) | parseCmdLine(s, value);
+        break;
+      case cmdLine_inpFile:
+        parsed = parseCmdLine(s, value) | parseInpFile(s, value);
+        break;
+      }
+      return parsed;
+
+    } catch (ParserException &e) {
+      throw ParserException("In option " + aliasList(s) + "\n" + e.what());
+    }
+  }
+
+  template<typename T_type, typename Test>
+  bool Parser::parseOption(const OptionHandle<T_type> &opt, T_type &value, parseMode mode) const
+  {
+    ReadLock lock(registryLock.mutex);
+    if (! opt.valid())
+      return false;
+
+    const Slot &s = resolve(opt.owner, opt.slot);
+    try {
+      bool parsed = findOption(opt, value, mode);
+      if (parsed) {
+        Test test(value);
+        test.run();
       }
+      return parsed;
+    } catch (ParserException &e) {
+      throw ParserException("Invalid range of parameter in option " +
+                            aliasList(s) + "\n" + e.what());
     }
-    // id is closed automatically no need for id.close();
-    return false;
   }
 
   template<typename T_type>
   bool Parser::parseOptions(const string &opt, std::vector<T_type> &values) const
   {
+    ReadLock lock(registryLock.mutex);
     if ( !isKeyDefined(opt) )
       return false;
 
-    for (ArgListConstIter A(Args.begin()); A!=Args.end(); ++A) {
-      for (AliasIter O(Aliases.find(opt)); O!=Aliases.upper_bound(opt); ++O) {
-        if (*A == O->second && *A != Args.back()) {
-          T_type value;
-          convert(*(++A), value);
-          values.push_back(value);
-        }
+    // the values following the aliases in command line order
+    ArgIndex::Positions positions;
+    for (AliasIter O(Aliases.find(opt)); O!=Aliases.upper_bound(opt); ++O) {
+      const ArgIndex::Positions *P = ArgsIndex.find(O->second);
+      if (P)
+        positions.insert(positions.end(), P->begin(), P->end());
+    }
+    std::sort(positions.begin(), positions.end());
+    for (size_t i=0; i<positions.size(); ++i) {
+      const string *next = ArgsIndex.next(positions[i]);
+      if (next) {
+        T_type value;
+        convert(*next, value);
+        values.push_back(value);
       }
     }
     return (values.empty() ? false : true);
@@ -409,52 +726,43 @@ namespace parser {
   template<typename T_type>
   void Parser::convert(const string &str, std::vector<T_type> &vec) const
   {
-
+    // elements converted in place, the vector sized once
+    const char *first = str.c_str(), *last = first+str.size();
     vec.clear();
-    string::size_type begin(0);
-    string::size_type end(str.npos);
-    while ( (end=str.find(',', begin)) != str.npos ) {
-      string sstr = str.substr(begin, end-begin);
+    vec.reserve(std::count(first, last, ',')+1);
+    for (const char *begin=first; ; ) {
+      const char *end = std::find(begin, last, ',');
       T_type value;
-      convert(sstr, value);
+      convertRange(begin, end, value);
       vec.push_back(value);
+      if (end == last)
+        break;
       begin = end+1;
     }
-    string sstr = str.substr(begin);
-    T_type value;
-    convert(sstr, value);
-    vec.push_back(value);
-
   }
 
 #ifdef BZ_TINYVEC_H
   template<typename T_type, int N>
   void Parser::convert(const string &str, blitz::TinyVector<T_type,N> &vec) const
   {
-    string::size_type begin(0);
-    string::size_type end(str.npos);
-    if ( (end=str.find(',', begin)) == str.npos ) {
+    const char *first = str.c_str(), *last = first+str.size();
+    int n = std::count(first, last, ',')+1;
+    if (n == 1) {
       T_type value;
-      convert(str, value);
+      convertRange(first, last, value);
       vec = value;
-    } else {
-      int i = 0;
-      do {
-        string sstr = str.substr(begin, end-begin);
-        T_type value;
-        convert(sstr, value);
-        vec(i++) = value;
-        begin = end+1;
-      } while ( (end=str.find(',', begin)) != str.npos && i < N );
-      string sstr = str.substr(begin);
-      T_type value;
-      convert(sstr, value);
-      vec(i) = value;
-      if ( i != N-1 ) {
-        ostringstream os;
-        os << "Incorrect length for vector '" << str <<  "': " << i+1 << ", should be " << N << ".";
-        throw ParserException(os.str());
-      }
+      return;
+    }
+    if (n != N) {
+      ostringstream os;
+      os << "Incorrect length for vector '" << str <<  "': " << n << ", should be " << N << ".";
+      throw ParserException(os.str());
+    }
+    const char *begin = first;
+    for (int i=0; i<N; ++i) {
+      const char *end = std::find(begin, last, ',');
+      convertRange(begin, end, vec(i));
+      begin = end+1;
     }
   }
 #endif
@@ -463,28 +771,16 @@ namespace parser {
   template<typename T_type>
   void Parser::convert(const string &str, blitz::Array<T_type,1> &vec) const
   {
-    string::size_type begin(0);
-    string::size_type end(str.npos);
-    if ( (end=str.find(',', begin)) == str.npos ) {
+    // one pass to count the elements, the array is resized once
+    const char *first = str.c_str(), *last = first+str.size();
+    vec.resize(std::count(first, last, ',')+1);
+    const char *begin = first;
+    for (int i=0; i<vec.extent(0); ++i) {
+      const char *end = std::find(begin, last, ',');
       T_type value;
-      convert(str, value);
-      vec.resize(1);
-      vec = value;
-    } else {
-      int i = 0;
-      do {
-        string sstr = str.substr(begin, end-begin);
-        T_type value;
-        convert(sstr, value);
-        vec.resizeAndPreserve(i+1);
-        vec(i++) = value;
-        begin = end+1;
-      } while ( (end=str.find(',', begin)) != str.npos );
-      string sstr = str.substr(begin);
-      T_type value;
-      convert(sstr, value);
-      vec.resizeAndPreserve(i+1);
+      convertRange(begin, end, value);
       vec(i) = value;
+      begin = end+1;
     }
   }
 
@@ -0,0 +1,191 @@
+/**************************************************************************
+ *
+ * $Id$
+ *
+ * Copyright (c) 2003-2011 Patrick Guio <patrick.guio@gmail.com>
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2.  of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************/
+
+#ifndef _PERF_COUNTERS_H
+#define _PERF_COUNTERS_H
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+
+#include <time-utils.h>
+
+#if defined(__linux__)
+#include <cstring>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/*
+ * Hardware performance counters of the calling thread (and by default of
+ * the threads it creates afterwards) with the Linux perf_event_open() interface.
+ *
+ * Each event is opened on its own so that a counter the hardware or the
+ * kernel does not provide, e.g. with kernel.perf_event_paranoid > 2 or in
+ * a virtual machine, is reported as unavailable (negative value) without
+ * disabling the others. Counts are scaled for multiplexing. On other
+ * systems all counters are unavailable.
+ */
+
+namespace perfcounters {
+
+  class Counters {
+  public:
+
+    enum eventType { cycles, instructions, l1dMisses, llcMisses,
+                     branchMisses, numEvents };
+
+    // With inherit the threads created afterwards by the calling thread
+    // are counted too
+    explicit Counters(bool enable=true, bool inherit=true) {
+      for (int e=0; e<numEvents; ++e) {
+        fd[e] = -1;
+        delta[e] = -1.0;
+        begin[e].value = begin[e].enabled = begin[e].running = 0;
+      }
+      if (enable)
+        for (int e=0; e<numEvents; ++e)
+          fd[e] = open(static_cast<eventType>(e), inherit);
+    }
+    ~Counters() {
+#if defined(__linux__)
+      for (int e=0; e<numEvents; ++e)
+        if (fd[e] >= 0)
+          close(fd[e]);
+#endif
+    }
+
+    static const char *name(eventType e) {
+      static const char *names[] = { "cycles", "instructions", "l1d-misses",
+                                     "llc-misses", "branch-misses" };
+      return names[e];
+    }
+    bool available(eventType e) const {
+      return fd[e] >= 0;
+    }
+    bool available() const {
+      for (int e=0; e<numEvents; ++e)
+        if (fd[e] >= 0)
+          return true;
+      return false;
+    }
+
+    void start() {
+      for (int e=0; e<numEvents; ++e)
+        if (fd[e] >= 0)
+          read(fd[e], begin[e]);
+    }
+    void stop() {
+      for (int e=0; e<numEvents; ++e) {
+        delta[e] = -1.0;
+        Reading end;
+        if (fd[e] >= 0 && read(fd[e], end) && end.running > begin[e].running)
+          delta[e] = static_cast<double>(end.value-begin[e].value)*
+                     (end.enabled-begin[e].enabled)/
+                     (end.running-begin[e].running);
+      }
+    }
+    // Count of event e between the last start() and stop(), negative if
+    // not available
+    double value(eventType e) const {
+      return delta[e];
+    }
+    // Counts since the counters were opened, scaled for multiplexing,
+    // negative if not available
+    void sample(double values[numEvents]) const {
+      for (int e=0; e<numEvents; ++e) {
+        Reading r;
+        values[e] = -1.0;
+        if (fd[e] >= 0 && read(fd[e], r) && r.running > 0)
+          values[e] = static_cast<double>(r.value)*r.enabled/r.running;
+      }
+    }
+    // Instructions per cycle, negative if not available
+    double ipc() const {
+      if (delta[cycles] > 0.0 && delta[instructions] >= 0.0)
+        return delta[instructions]/delta[cycles];
+      return -1.0;
+    }
+
+  private:
+
+    struct Reading {
+      unsigned long long value, enabled, running;
+    };
+
+    int fd[numEvents];
+    Reading begin[numEvents];
+    double delta[numEvents];
+
+    Counters(const Counters &);
+    Counters &operator=(const Counters &);
+
+#if defined(__linux__)
+    static int open(eventType e, bool inherit) {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      switch (e) {
+      case cycles:
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+      case instructions:
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+      case l1dMisses:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_L1D |
+                      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+      case llcMisses:
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        break;
+      default:
+        attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+      }
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                         PERF_FORMAT_TOTAL_TIME_RUNNING;
+      attr.inherit = inherit ? 1 : 0;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    static bool read(int fd, Reading &r) {
+      return ::read(fd, &r, sizeof(r)) == static_cast<ssize_t>(sizeof(r));
+    }
+#else
+    static int open(eventType, bool) {
+      return -1;
+    }
+    static bool read(int, Reading &) {
+      return false;
+    }
+#endif
+  };
+
+}
+
+#endif // _PERF_COUNTERS_H
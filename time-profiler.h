@@ -0,0 +1,1037 @@
+/**************************************************************************
+ *
+ * $Id$
+ *
+ * Copyright (c) 2003-2011 Patrick Guio <patrick.guio@gmail.com>
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2.  of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************/
+
+#ifndef _TIME_PROFILER_H
+#define _TIME_PROFILER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <time-utils.h>
+#include <perf-counters.h>
+
+/*
+ * Hierarchical region profiler
+ *
+ *   void solve()
+ *   {
+ *     TIMEUTILS_SCOPE("solve");
+ *     ...
+ *     {
+ *       TIMEUTILS_SCOPE("fft");
+ *       ...
+ *     }
+ *   }
+ *   ...
+ *   timeutils::Profiler::report(std::cout);
+ *
+ * Entering and leaving a region append a time stamp (TSC ticks where
+ * available, CLOCK_MONOTONIC otherwise) to a buffer owned by the calling
+ * thread, without lock nor atomic read-modify-write, which costs a few
+ * tens of ns. Full buffers are folded into the call tree of the thread
+ * by the thread itself under a lock of its own, so that memory stays
+ * bounded for long runs. The report can be requested from any thread at
+ * any time: it replays the events not folded yet under that lock without
+ * modifying the buffers, and merges the call trees of all the threads,
+ * including the threads that have exited, with the number of calls and
+ * the inclusive and exclusive times of every region.
+ *
+ * With counters(true) the hardware counters of perf-counters.h are also
+ * read when entering and leaving a region, which costs a few system calls,
+ * and the report adds the IPC and the cache and branch misses per call of
+ * every region.
+ *
+ * With trace(true) the begin and end events are also kept and
+ * writeTrace() writes them in the Chrome trace JSON format, one process
+ * per MPI rank and one thread per thread, to be opened with
+ * chrome://tracing or https://ui.perfetto.dev. Time stamps are taken from
+ * MPI_Wtime() with HAVE_MPI, CLOCK_MONOTONIC otherwise, and the clocks of
+ * the ranks are aligned on rank 0 so that the load imbalance between
+ * ranks can be read from the trace.
+ *
+ * reportRanks() reduces the inclusive times of the regions over the ranks
+ * of MPI_COMM_WORLD and prints their spread from rank 0. reduceRanks()
+ * does the same for any set of named times, e.g. Timer::mpiElapsed().
+ *
+ * Defining TIMEUTILS_NO_PROFILER compiles the regions out.
+ */
+
+namespace timeutils {
+
+  class Profiler {
+  public:
+
+    enum { numCounters = perfcounters::Counters::numEvents };
+
+    // Region of the call tree merged over threads, in depth first order
+    struct Node {
+      std::string name;
+      int depth;
+      int parent;         // index of the parent node, -1 at top level
+      long long calls;
+      double inclusive;   // s, with the time spent in the children
+      double exclusive;   // s, without the time spent in the children
+      long long counted;  // calls with hardware counters
+      double counts[numCounters];   // summed over the counted calls,
+                                    // negative if not available
+    };
+
+    // Identifier of the region name, the same for all the regions with
+    // the same name
+    static int region(const char *name) {
+      Registry &r = registry();
+      std::lock_guard<std::mutex> guard(r.lock);
+      for (size_t i=0; i<r.names.size(); ++i)
+        if (r.names[i] == name)
+          return static_cast<int>(i);
+      r.names.push_back(name);
+      return static_cast<int>(r.names.size()-1);
+    }
+
+    static void enter(int id) {
+      ThreadData &d = thread();
+      int n = d.n.load(std::memory_order_relaxed);
+      if (n == ThreadData::capacity)
+        n = d.fold();
+      Event &e = d.events[n];
+      e.region = id;
+      e.counted = countingRef().load(std::memory_order_relaxed);
+      if (e.counted)
+        d.sample(n);
+      e.tick = ticks();
+      d.n.store(n+1, std::memory_order_release);
+    }
+    static void leave() {
+      long long t = ticks();
+      ThreadData &d = thread();
+      int n = d.n.load(std::memory_order_relaxed);
+      if (n == ThreadData::capacity)
+        n = d.fold();
+      Event &e = d.events[n];
+      e.region = -1;
+      e.tick = t;
+      e.counted = countingRef().load(std::memory_order_relaxed);
+      if (e.counted)
+        d.sample(n);
+      d.n.store(n+1, std::memory_order_release);
+    }
+
+    // Regions entered while disabled are not recorded
+    static void enable(bool on) {
+      enabledRef().store(on, std::memory_order_relaxed);
+    }
+    static bool enabled() {
+      return enabledRef().load(std::memory_order_relaxed);
+    }
+
+    // Read the hardware counters in the regions entered from now on
+    static void counters(bool on) {
+      countingRef().store(on, std::memory_order_relaxed);
+    }
+    static bool counting() {
+      return countingRef().load(std::memory_order_relaxed);
+    }
+
+    static long long ticks() {
+#if defined(TIMEUTILS_HAVE_TSC)
+      return static_cast<long long>(__rdtsc());
+#else
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return 1000000000LL*ts.tv_sec+ts.tv_nsec;
+#endif
+    }
+    static double secondsPerTick() {
+#if defined(TIMEUTILS_HAVE_TSC)
+      return 1.0e-9*Timer::nsPerTick();
+#else
+      return 1.0e-9;
+#endif
+    }
+
+    // Call tree merged over the threads. Regions still open are counted
+    // up to now but not as a call.
+    static void tree(std::vector<Node> &nodes) {
+      Registry &r = registry();
+      std::lock_guard<std::mutex> guard(r.lock);
+      std::vector<TreeNode> merged(r.exited);
+      for (size_t i=0; i<r.threads.size(); ++i) {
+        ThreadData &d = *r.threads[i];
+        CallTree snapshot;
+        {
+          std::lock_guard<std::mutex> dataGuard(d.lock);
+          d.snapshot(snapshot);
+        }
+        long long now = ticks();
+        for (size_t k=0; k<snapshot.stack.size(); ++k)
+          snapshot.nodes[snapshot.stack[k].node].ticks +=
+            now-snapshot.stack[k].tick;
+        merge(snapshot.nodes, 0, merged, 0);
+      }
+      nodes.clear();
+      flatten(merged, 0, -1, -1, secondsPerTick(), r.names, nodes);
+    }
+
+    // Number of threads that have entered a region
+    static int threads() {
+      Registry &r = registry();
+      std::lock_guard<std::mutex> guard(r.lock);
+      return r.count;
+    }
+
+    static void report(std::ostream &os) {
+      std::vector<Node> nodes;
+      tree(nodes);
+      double total = 0.0;
+      bool counted = false;
+      for (size_t i=0; i<nodes.size(); ++i) {
+        if (nodes[i].depth == 0)
+          total += nodes[i].inclusive;
+        if (nodes[i].counted > 0)
+          counted = true;
+      }
+      const perfcounters::Counters::eventType misses[] = {
+        perfcounters::Counters::l1dMisses, perfcounters::Counters::llcMisses,
+        perfcounters::Counters::branchMisses
+      };
+      std::ios::fmtflags f = os.flags();
+      std::streamsize p = os.precision();
+      os << "Profile of " << threads() << " thread(s), " << toHMS(total)
+         << " in top-level regions\n"
+         << std::left << std::setw(32) << "region" << std::right
+         << std::setw(10) << "calls" << std::setw(14) << "inclusive"
+         << std::setw(7) << "%" << std::setw(14) << "exclusive"
+         << std::setw(7) << "%" << std::setw(14) << "per call";
+      if (counted) {
+        os << std::setw(7) << "IPC";
+        for (int k=0; k<3; ++k)
+          os << std::setw(15) << perfcounters::Counters::name(misses[k]);
+      }
+      os << '\n';
+      for (size_t i=0; i<nodes.size(); ++i) {
+        const Node &x = nodes[i];
+        double perCall = x.calls > 0 ? x.inclusive/x.calls : 0.0;
+        os << std::left << std::setw(32)
+           << std::string(2*x.depth, ' ')+x.name << std::right
+           << std::setw(10) << x.calls
+           << std::setw(14) << formatTime(x.inclusive) << std::fixed
+           << std::setprecision(1) << std::setw(7)
+           << (total > 0.0 ? 100.0*x.inclusive/total : 0.0)
+           << std::setw(14) << formatTime(x.exclusive) << std::setw(7)
+           << (total > 0.0 ? 100.0*x.exclusive/total : 0.0)
+           << std::setw(14) << formatTime(perCall);
+        if (counted) {
+          // per counted call, - if not available
+          const double *c = x.counts;
+          if (x.counted > 0 && c[perfcounters::Counters::cycles] > 0.0 &&
+              c[perfcounters::Counters::instructions] >= 0.0)
+            os << std::setprecision(2) << std::setw(7)
+               << c[perfcounters::Counters::instructions]/
+                  c[perfcounters::Counters::cycles];
+          else
+            os << std::setw(7) << '-';
+          for (int k=0; k<3; ++k)
+            if (x.counted > 0 && c[misses[k]] >= 0.0)
+              os << std::setprecision(0) << std::setw(15)
+                 << c[misses[k]]/x.counted;
+            else
+              os << std::setw(15) << '-';
+        }
+        os << '\n';
+        os.flags(f);
+      }
+      os.precision(p);
+      os.flush();
+    }
+
+    // Statistics of a named time over the ranks
+    struct RankStats {
+      std::string name;
+      int ranks;          // number of ranks with this name
+      double min, max, mean, stddev;
+      double imbalance;   // max/mean
+      int fastest, slowest;
+    };
+
+    // Reduce named times over MPI_COMM_WORLD with a single MPI_Reduce of
+    // a buffer holding up to capacity names, which must be the same on
+    // all ranks. Collective, stats is set on rank 0 in the order of its
+    // names, followed by the names it does not have (as their hash).
+    // Returns the number of entries that did not fit in the buffer.
+    static int reduceRanks(const std::vector<std::string> &names,
+                           const std::vector<double> &times,
+                           std::vector<RankStats> &stats, int capacity=256) {
+      int rank = 0;
+#if defined(HAVE_MPI)
+      MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+#endif
+      std::vector<Entry> local(capacity+1);
+      std::vector<unsigned long long> hashes(names.size());
+      for (size_t i=0; i<names.size(); ++i) {
+        hashes[i] = hash(names[i]);
+        Entry one[2];
+        one[0].hash = 1;
+        one[1].hash = hashes[i];
+        one[1].ranks = 1;
+        one[1].min = one[1].max = one[1].sum = times[i];
+        one[1].sumsq = times[i]*times[i];
+        one[1].fastest = one[1].slowest = rank;
+        // merging also sums the times of repeated names
+        merge(one, &local[0], capacity, true);
+      }
+      std::vector<Entry> global(local.size());
+#if defined(HAVE_MPI)
+      MPI_Datatype type = bufferType(capacity);
+      MPI_Op op;
+      MPI_Op_create(&mergeOp, 1, &op);
+      MPI_Reduce(&local[0], &global[0], 1, type, op, 0, MPI_COMM_WORLD);
+      MPI_Op_free(&op);
+      MPI_Type_free(&type);
+#else
+      global = local;
+#endif
+      stats.clear();
+      if (rank != 0)
+        return 0;
+      int n = static_cast<int>(global[0].hash);
+      std::vector<bool> found(n, false);
+      for (size_t i=0; i<names.size(); ++i) {
+        for (int k=0; k<n; ++k) {
+          const Entry &e = global[k+1];
+          if (e.hash == hashes[i] && !found[k]) {
+            stats.push_back(rankStats(names[i], e));
+            found[k] = true;
+          }
+        }
+      }
+      for (int k=0; k<n; ++k)
+        if (!found[k]) {
+          const Entry &e = global[k+1];
+          std::ostringstream name;
+          name << '#' << std::hex << e.hash;
+          stats.push_back(rankStats(name.str(), e));
+        }
+      return global[0].ranks;
+    }
+
+    // Inclusive times of the regions reduced over the ranks, printed by
+    // rank 0. Collective.
+    static void reportRanks(std::ostream &os, int capacity=256) {
+      std::vector<Node> nodes;
+      tree(nodes);
+      std::vector<std::string> paths(nodes.size());
+      std::vector<double> times(nodes.size());
+      for (size_t i=0; i<nodes.size(); ++i) {
+        paths[i] = (nodes[i].parent >= 0 ? paths[nodes[i].parent]+"/" : "")
+                   +nodes[i].name;
+        times[i] = nodes[i].inclusive;
+      }
+      std::vector<RankStats> stats;
+      int overflow = reduceRanks(paths, times, stats, capacity);
+      int rank = 0, size = 1;
+#if defined(HAVE_MPI)
+      MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+      MPI_Comm_size(MPI_COMM_WORLD, &size);
+#endif
+      if (rank != 0)
+        return;
+      // regions of rank 0 indented as its call tree
+      std::map<std::string, std::string> display;
+      for (size_t i=0; i<nodes.size(); ++i)
+        display[paths[i]] = std::string(2*nodes[i].depth, ' ')+nodes[i].name;
+      std::ios::fmtflags f = os.flags();
+      std::streamsize p = os.precision();
+      os << "Profile of " << size << " rank(s)\n"
+         << std::left << std::setw(32) << "region" << std::right
+         << std::setw(6) << "ranks" << std::setw(12) << "min"
+         << std::setw(12) << "max" << std::setw(12) << "mean"
+         << std::setw(12) << "stddev" << std::setw(10) << "max/mean"
+         << std::setw(8) << "slowest" << '\n';
+      for (size_t i=0; i<stats.size(); ++i) {
+        const RankStats &x = stats[i];
+        std::map<std::string, std::string>::const_iterator d =
+          display.find(x.name);
+        os << std::left << std::setw(32)
+           << (d != display.end() ? d->second : x.name) << std::right
+           << std::setw(6) << x.ranks << std::setw(12) << formatTime(x.min)
+           << std::setw(12) << formatTime(x.max)
+           << std::setw(12) << formatTime(x.mean)
+           << std::setw(12) << formatTime(x.stddev) << std::fixed
+           << std::setprecision(2) << std::setw(10) << x.imbalance
+           << std::setw(8) << x.slowest << '\n';
+        os.flags(f);
+      }
+      if (overflow > 0)
+        os << overflow << " region(s) not reduced, capacity " << capacity
+           << " too small\n";
+      os.precision(p);
+      os.flush();
+    }
+
+    // Forget the regions recorded so far
+    static void reset() {
+      Registry &r = registry();
+      std::lock_guard<std::mutex> guard(r.lock);
+      for (size_t i=0; i<r.threads.size(); ++i) {
+        ThreadData &d = *r.threads[i];
+        std::lock_guard<std::mutex> dataGuard(d.lock);
+        // the owner may be appending events, skip the ones written so far
+        d.start = d.n.load(std::memory_order_acquire);
+        d.tree = CallTree();
+        d.trace.clear();
+        d.dropped = 0;
+      }
+      r.exited.assign(1, TreeNode(-1, -1));
+      r.exitedTraces.clear();
+      r.dropped = 0;
+    }
+
+    // Start or stop keeping the events for writeTrace(), at most
+    // maxEvents per thread. The timestamps are counted from the first
+    // start, so that the events kept before a stop stay aligned with the
+    // ones kept after a restart.
+    static void trace(bool on, size_t maxEvents=1<<20) {
+      Registry &r = registry();
+      std::lock_guard<std::mutex> guard(r.lock);
+      if (on && r.tick0 == 0) {
+        r.tick0 = ticks();
+        r.time0 = wallClock();
+      }
+      if (on)
+        r.traceLimit = maxEvents;
+      r.tracing = on;
+      for (size_t i=0; i<r.threads.size(); ++i) {
+        ThreadData &d = *r.threads[i];
+        std::lock_guard<std::mutex> dataGuard(d.lock);
+        d.traceFrom(on, r.traceLimit, d.n.load(std::memory_order_acquire));
+      }
+    }
+
+    // Write the events kept since trace(true) to file in the Chrome trace
+    // format. With HAVE_MPI it is collective over MPI_COMM_WORLD and rank
+    // 0 writes the events of all the ranks, received from one rank after
+    // the other in chunks. Returns false if the file cannot be written.
+    static bool writeTrace(const std::string &file) {
+      Registry &r = registry();
+      int rank = 0, size = 1;
+#if defined(HAVE_MPI)
+      MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+      MPI_Comm_size(MPI_COMM_WORLD, &size);
+#endif
+      double offset = clockOffset();
+      std::vector<std::pair<int, std::vector<Event> > > traces;
+      std::vector<std::string> names;
+      long long dropped = 0, tick0;
+      double time0, spt;
+      {
+        std::lock_guard<std::mutex> guard(r.lock);
+        traces = r.exitedTraces;
+        names = r.names;
+        dropped = r.dropped;
+        for (size_t i=0; i<r.threads.size(); ++i) {
+          ThreadData &d = *r.threads[i];
+          std::lock_guard<std::mutex> dataGuard(d.lock);
+          traces.push_back(std::make_pair(d.id, std::vector<Event>()));
+          dropped += d.keep(traces.back().second);
+        }
+        // rate of the ticks measured against the wall clock over the trace
+        tick0 = r.tick0;
+        time0 = r.time0;
+        long long tick1 = ticks();
+        double time1 = wallClock();
+        spt = (tick1 > tick0 && time1 > time0) ?
+              (time1-time0)/(tick1-tick0) : secondsPerTick();
+      }
+      // collective, out of the lock so that threads may start or exit
+      double start = time0+offset;
+#if defined(HAVE_MPI)
+      MPI_Allreduce(MPI_IN_PLACE, &start, 1, MPI_DOUBLE, MPI_MIN,
+                    MPI_COMM_WORLD);
+#endif
+      std::ostringstream os;
+      os << std::fixed << std::setprecision(3)
+         << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": "
+         << rank << ", \"args\": {\"name\": \"rank " << rank
+         << "\"}}";
+      for (size_t i=0; i<traces.size(); ++i) {
+        int tid = traces[i].first;
+        const std::vector<Event> &trace = traces[i].second;
+        os << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": "
+           << rank << ", \"tid\": " << tid << ", \"args\": {\"name\": "
+           << "\"thread " << tid << "\"}}";
+        for (size_t k=0; k<trace.size(); ++k) {
+          const Event &e = trace[k];
+          double ts = 1.0e6*(time0+offset-start+spt*(e.tick-tick0));
+          os << ",\n{";
+          if (e.region >= 0)
+            os << "\"name\": " << jsonString(names[e.region])
+               << ", \"cat\": \"region\", \"ph\": \"B\"";
+          else
+            os << "\"ph\": \"E\"";
+          os << ", \"ts\": " << ts << ", \"pid\": " << rank
+             << ", \"tid\": " << tid << "}";
+        }
+      }
+      std::string events(os.str());
+#if defined(HAVE_MPI)
+      MPI_Allreduce(MPI_IN_PLACE, &dropped, 1, MPI_LONG_LONG, MPI_SUM,
+                    MPI_COMM_WORLD);
+#endif
+      std::ofstream f;
+      if (rank == 0) {
+        f.open(file.c_str());
+        f << "{\"traceEvents\": [\n" << events;
+      }
+#if defined(HAVE_MPI)
+      // the events of a rank may not fit in an int count
+      const long long chunk = 1<<26;
+      const int tag = 0x7acf;
+      for (int p=1; p<size; ++p) {
+        if (rank == p) {
+          long long length = static_cast<long long>(events.size());
+          MPI_Send(&length, 1, MPI_LONG_LONG, 0, tag, MPI_COMM_WORLD);
+          for (long long k=0; k<length; k+=chunk)
+            MPI_Send(&events[k], static_cast<int>(std::min(chunk, length-k)),
+                     MPI_CHAR, 0, tag, MPI_COMM_WORLD);
+        } else if (rank == 0) {
+          long long length;
+          MPI_Recv(&length, 1, MPI_LONG_LONG, p, tag, MPI_COMM_WORLD,
+                   MPI_STATUS_IGNORE);
+          std::vector<char> buffer(std::min(chunk, length));
+          f << ",\n";
+          for (long long k=0; k<length; k+=chunk) {
+            int n = static_cast<int>(std::min(chunk, length-k));
+            MPI_Recv(&buffer[0], n, MPI_CHAR, p, tag, MPI_COMM_WORLD,
+                     MPI_STATUS_IGNORE);
+            f.write(&buffer[0], n);
+          }
+        }
+      }
+#endif
+      int ok = 1;
+      if (rank == 0) {
+        f << "\n],\n"
+          << "\"displayTimeUnit\": \"ms\",\n"
+          << "\"otherData\": {\"ranks\": " << size
+          << ", \"dropped_events\": " << dropped << "}}\n";
+        f.close();
+        ok = f ? 1 : 0;
+      }
+#if defined(HAVE_MPI)
+      MPI_Bcast(&ok, 1, MPI_INT, 0, MPI_COMM_WORLD);
+#endif
+      return ok != 0;
+    }
+
+  private:
+
+    struct Event {
+      long long tick;
+      int region;         // -1 when leaving
+      bool counted;       // with a sample of the hardware counters
+    };
+    struct Sample {
+      double counts[numCounters];
+    };
+    struct TreeNode {
+      int region, parent, child, sibling;
+      long long calls, ticks, counted;
+      double counts[numCounters];
+      TreeNode(int _region, int _parent) : region(_region), parent(_parent),
+        child(-1), sibling(-1), calls(0), ticks(0), counted(0) {
+        std::fill(counts, counts+numCounters, -1.0);
+      }
+      void count(const double *begin, const double *end) {
+        ++counted;
+        for (int k=0; k<numCounters; ++k)
+          if (begin[k] >= 0.0 && end[k] >= 0.0)
+            counts[k] = std::max(counts[k], 0.0)+end[k]-begin[k];
+      }
+    };
+    struct Open {
+      int node;
+      long long tick;
+      bool counted;
+      Sample begin;
+    };
+
+    struct CallTree {
+      std::vector<TreeNode> nodes;    // nodes[0] is the root
+      std::vector<Open> stack;        // regions entered and not yet left
+
+      CallTree() : nodes(1, TreeNode(-1, -1)), stack() {}
+
+      void add(const Event &e, const Sample *sample) {
+        if (e.region >= 0) {
+          int parent = stack.empty() ? 0 : stack.back().node;
+          Open o;
+          o.node = child(parent, e.region);
+          o.tick = e.tick;
+          o.counted = e.counted;
+          if (o.counted)
+            o.begin = *sample;
+          stack.push_back(o);
+        } else if (!stack.empty()) {
+          const Open &o = stack.back();
+          TreeNode &x = nodes[o.node];
+          ++x.calls;
+          x.ticks += e.tick-o.tick;
+          if (o.counted && e.counted)
+            x.count(o.begin.counts, sample->counts);
+          stack.pop_back();
+        }
+      }
+      int child(int parent, int region) {
+        int c = nodes[parent].child;
+        for (; c >= 0; c = nodes[c].sibling)
+          if (nodes[c].region == region)
+            return c;
+        nodes.push_back(TreeNode(region, parent));
+        c = static_cast<int>(nodes.size()-1);
+        nodes[c].sibling = nodes[parent].child;
+        nodes[parent].child = c;
+        return c;
+      }
+    };
+
+    // Only the owner thread writes the events and folds them, under lock.
+    // The other threads read the events published by n under lock and
+    // leave them in place, the owner cannot overwrite them before folding.
+    struct ThreadData {
+      enum { capacity = 4096 };
+      Event events[capacity];
+      std::atomic<Sample*> samples;   // of the counted events, published
+                                      // by the owner on the first sample
+      std::atomic<int> n;             // events published by the owner
+      int start;                      // events before start were reset
+      std::mutex lock;
+      int id;
+      CallTree tree;
+      std::vector<Event> trace;       // events kept for writeTrace()
+      bool tracing;                   // keep the events from traceBegin on,
+      int traceBegin, traceEnd;       // or up to traceEnd when not tracing
+      size_t traceLimit;
+      long long dropped;
+      perfcounters::Counters *counters;   // opened on the first sample
+
+      explicit ThreadData(int _id) : samples(0), n(0), start(0), lock(),
+        id(_id), tree(), trace(), tracing(false), traceBegin(0),
+        traceEnd(0), traceLimit(0), dropped(0), counters(0) {}
+      ~ThreadData() {
+        delete counters;
+        delete[] samples.load();
+      }
+
+      void sample(int i) {
+        Sample *s = samples.load(std::memory_order_relaxed);
+        if (!s) {
+          counters = new perfcounters::Counters(true, false);
+          s = new Sample[capacity];
+          samples.store(s, std::memory_order_release);
+        }
+        counters->sample(s[i].counts);
+      }
+
+      // replay the buffered events into the call tree, by the owner only,
+      // and return the new number of events
+      int fold() {
+        std::lock_guard<std::mutex> guard(lock);
+        int m = n.load(std::memory_order_relaxed);
+        Sample *s = samples.load(std::memory_order_relaxed);
+        dropped += keep(trace, m);
+        for (int i=start; i<m; ++i)
+          tree.add(events[i], s ? &s[i] : 0);
+        start = traceBegin = traceEnd = 0;
+        n.store(0, std::memory_order_relaxed);
+        return 0;
+      }
+      // the call tree with the events not folded yet, under lock
+      void snapshot(CallTree &t) const {
+        int m = n.load(std::memory_order_acquire);
+        Sample *s = samples.load(std::memory_order_acquire);
+        t = tree;
+        for (int i=start; i<m; ++i)
+          t.add(events[i], s ? &s[i] : 0);
+      }
+      // the kept events with the ones not folded yet, under lock, and
+      // return the number of events dropped
+      long long keep(std::vector<Event> &t) const {
+        t = trace;
+        return dropped+keep(t, n.load(std::memory_order_acquire));
+      }
+      long long keep(std::vector<Event> &t, int m) const {
+        int from = std::max(start, traceBegin);
+        int to = tracing ? m : std::min(traceEnd, m);
+        if (from >= to)
+          return 0;
+        size_t k = std::min(static_cast<size_t>(to-from),
+                            traceLimit-std::min(traceLimit, t.size()));
+        t.insert(t.end(), events+from, events+from+k);
+        return to-from-k;
+      }
+      // start or stop keeping the events from the buffer position m on,
+      // under lock
+      void traceFrom(bool on, size_t limit, int m) {
+        traceLimit = limit;
+        if (on && !tracing) {
+          // the events of the previous window, not the ones of the pause
+          dropped += keep(trace, m);
+          traceBegin = traceEnd = m;
+        } else if (!on && tracing)
+          traceEnd = m;
+        tracing = on;
+      }
+    };
+
+    struct Registry {
+      std::mutex lock;
+      std::vector<std::string> names;
+      std::vector<ThreadData*> threads;   // running threads
+      int count;                          // threads registered so far
+      std::vector<TreeNode> exited;       // call tree of the exited threads
+      std::vector<std::pair<int, std::vector<Event> > > exitedTraces;
+      long long dropped;                  // events of the exited threads
+      bool tracing;
+      size_t traceLimit;
+      long long tick0;                    // ticks and wall clock at the
+      double time0;                       // first start of the trace
+      Registry() : lock(), names(), threads(), count(0),
+        exited(1, TreeNode(-1, -1)), exitedTraces(), dropped(0),
+        tracing(false), traceLimit(0), tick0(0), time0(0.0) {}
+    };
+
+    static Registry &registry() {
+      static Registry r;
+      return r;
+    }
+    static std::atomic<bool> &enabledRef() {
+      static std::atomic<bool> on(true);
+      return on;
+    }
+    static std::atomic<bool> &countingRef() {
+      static std::atomic<bool> on(false);
+      return on;
+    }
+
+    static double wallClock() {
+#if defined(HAVE_MPI)
+      return MPI_Wtime();
+#else
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return ts.tv_sec+1.0e-9*ts.tv_nsec;
+#endif
+    }
+
+    // Offset to add to wallClock() to get the wall clock of rank 0, from
+    // the round trip with the smallest latency out of a few ping-pongs
+    // between rank 0 and every other rank
+    static double clockOffset() {
+      double offset = 0.0;
+#if defined(HAVE_MPI)
+      int rank, size;
+      MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+      MPI_Comm_size(MPI_COMM_WORLD, &size);
+      const int rounds = 10, tag = 0x7ace;
+      MPI_Barrier(MPI_COMM_WORLD);
+      for (int p=1; p<size; ++p) {
+        if (rank == 0) {
+          for (int k=0; k<rounds; ++k) {
+            double t;
+            MPI_Recv(&t, 1, MPI_DOUBLE, p, tag, MPI_COMM_WORLD,
+                     MPI_STATUS_IGNORE);
+            t = MPI_Wtime();
+            MPI_Send(&t, 1, MPI_DOUBLE, p, tag, MPI_COMM_WORLD);
+          }
+        } else if (rank == p) {
+          double best = -1.0;
+          for (int k=0; k<rounds; ++k) {
+            double t0 = MPI_Wtime(), t;
+            MPI_Send(&t0, 1, MPI_DOUBLE, 0, tag, MPI_COMM_WORLD);
+            MPI_Recv(&t, 1, MPI_DOUBLE, 0, tag, MPI_COMM_WORLD,
+                     MPI_STATUS_IGNORE);
+            double t1 = MPI_Wtime();
+            if (best < 0.0 || t1-t0 < best) {
+              best = t1-t0;
+              offset = t-0.5*(t0+t1);
+            }
+          }
+        }
+      }
+#endif
+      return offset;
+    }
+
+    // Hands the data of the thread over to the registry at thread exit
+    struct Owner {
+      ThreadData **data;
+      ~Owner() {
+        if (*data) {
+          retire(*data);
+          *data = 0;
+        }
+      }
+    };
+
+    static ThreadData &thread() {
+      static thread_local ThreadData *d = 0;
+      if (!d) {
+        static thread_local Owner owner = { &d };
+        Registry &r = registry();
+        std::lock_guard<std::mutex> guard(r.lock);
+        d = new ThreadData(r.count++);
+        d->traceFrom(r.tracing, r.traceLimit, 0);
+        r.threads.push_back(d);
+      }
+      return *d;
+    }
+
+    // Regions still open when a thread exits are not counted
+    static void retire(ThreadData *d) {
+      d->fold();
+      Registry &r = registry();
+      std::lock_guard<std::mutex> guard(r.lock);
+      r.threads.erase(std::find(r.threads.begin(), r.threads.end(), d));
+      merge(d->tree.nodes, 0, r.exited, 0);
+      if (!d->trace.empty())
+        r.exitedTraces.push_back(std::make_pair(d->id, d->trace));
+      r.dropped += d->dropped;
+      delete d;
+    }
+
+    static void merge(const std::vector<TreeNode> &src, int s,
+                      std::vector<TreeNode> &dst, int d) {
+      dst[d].calls += src[s].calls;
+      dst[d].ticks += src[s].ticks;
+      dst[d].counted += src[s].counted;
+      for (int k=0; k<numCounters; ++k)
+        if (src[s].counts[k] >= 0.0)
+          dst[d].counts[k] = std::max(dst[d].counts[k], 0.0)+src[s].counts[k];
+      // children are linked from the last created
+      std::vector<int> children;
+      for (int c=src[s].child; c>=0; c=src[c].sibling)
+        children.push_back(c);
+      for (size_t i=children.size(); i-->0; ) {
+        int c = children[i];
+        int k = dst[d].child;
+        while (k >= 0 && dst[k].region != src[c].region)
+          k = dst[k].sibling;
+        if (k < 0) {
+          dst.push_back(TreeNode(src[c].region, d));
+          k = static_cast<int>(dst.size()-1);
+          dst[k].sibling = dst[d].child;
+          dst[d].child = k;
+        }
+        merge(src, c, dst, k);
+      }
+    }
+
+    // children in the order of their first call
+    static void flatten(const std::vector<TreeNode> &src, int s, int depth,
+                        int parent, double spt,
+                        const std::vector<std::string> &names,
+                        std::vector<Node> &nodes) {
+      int self = parent;
+      if (s > 0) {
+        Node x;
+        x.name = names[src[s].region];
+        x.depth = depth;
+        x.parent = parent;
+        x.calls = src[s].calls;
+        x.inclusive = x.exclusive = spt*src[s].ticks;
+        x.counted = src[s].counted;
+        std::copy(src[s].counts, src[s].counts+numCounters, x.counts);
+        for (int c=src[s].child; c>=0; c=src[c].sibling)
+          x.exclusive -= spt*src[c].ticks;
+        nodes.push_back(x);
+        self = static_cast<int>(nodes.size()-1);
+      }
+      std::vector<int> children;
+      for (int c=src[s].child; c>=0; c=src[c].sibling)
+        children.push_back(c);
+      for (size_t i=children.size(); i-->0; )
+        flatten(src, children[i], depth+1, self, spt, names, nodes);
+    }
+
+    // A reduction buffer holds capacity+1 entries, the first one with the
+    // number of entries in hash and the number of entries that did not
+    // fit in ranks, the others sorted by hash
+    struct Entry {
+      unsigned long long hash;
+      int ranks, fastest, slowest;    // rank of min and of max
+      double min, max, sum, sumsq;
+      Entry() : hash(0), ranks(0), fastest(0), slowest(0), min(0.0),
+        max(0.0), sum(0.0), sumsq(0.0) {}
+    };
+
+    static unsigned long long hash(const std::string &s) {
+      unsigned long long h = 14695981039346656037ULL;
+      for (size_t i=0; i<s.size(); ++i) {
+        h ^= static_cast<unsigned char>(s[i]);
+        h *= 1099511628211ULL;
+      }
+      return h;
+    }
+
+    // Merge the entries of a into b, sum combines the entries of the same
+    // rank instead
+    static void merge(const Entry *a, Entry *b, int capacity, bool sum) {
+      std::vector<Entry> c(capacity+1);
+      int na = static_cast<int>(a[0].hash), nb = static_cast<int>(b[0].hash);
+      int ia = 0, ib = 0, n = 0, dropped = a[0].ranks+b[0].ranks;
+      while (ia < na || ib < nb) {
+        const Entry &x = a[ia+1], &y = b[ib+1];
+        const Entry *from;
+        if (ib == nb || (ia < na && x.hash < y.hash)) {
+          from = &x;
+          ++ia;
+        } else if (ia == na || y.hash < x.hash) {
+          from = &y;
+          ++ib;
+        } else {
+          from = 0;
+          ++ia;
+          ++ib;
+        }
+        if (n == capacity) {
+          ++dropped;
+          continue;
+        }
+        Entry &z = c[n+1];
+        if (from) {
+          z = *from;
+        } else if (sum) {
+          z = x;
+          z.min = z.max = z.sum = x.sum+y.sum;
+          z.sumsq = z.sum*z.sum;
+        } else {
+          z.hash = x.hash;
+          z.ranks = x.ranks+y.ranks;
+          bool xMin = x.min < y.min ||
+                      (x.min == y.min && x.fastest < y.fastest);
+          bool xMax = x.max > y.max ||
+                      (x.max == y.max && x.slowest < y.slowest);
+          z.min = xMin ? x.min : y.min;
+          z.fastest = xMin ? x.fastest : y.fastest;
+          z.max = xMax ? x.max : y.max;
+          z.slowest = xMax ? x.slowest : y.slowest;
+          z.sum = x.sum+y.sum;
+          z.sumsq = x.sumsq+y.sumsq;
+        }
+        ++n;
+      }
+      c[0].hash = n;
+      c[0].ranks = dropped;
+      std::copy(c.begin(), c.end(), b);
+    }
+
+#if defined(HAVE_MPI)
+    // A whole buffer, with the hash as an integer of 64 bits
+    static MPI_Datatype bufferType(int capacity) {
+      int lengths[] = { 1, 3, 4 };
+      MPI_Aint displs[] = { offsetof(Entry, hash), offsetof(Entry, ranks),
+                            offsetof(Entry, min) };
+      MPI_Datatype types[] = { MPI_UINT64_T, MPI_INT, MPI_DOUBLE };
+      MPI_Datatype entry, resized, type;
+      MPI_Type_create_struct(3, lengths, displs, types, &entry);
+      MPI_Type_create_resized(entry, 0, sizeof(Entry), &resized);
+      MPI_Type_contiguous(capacity+1, resized, &type);
+      MPI_Type_commit(&type);
+      MPI_Type_free(&resized);
+      MPI_Type_free(&entry);
+      return type;
+    }
+
+    static void mergeOp(void *in, void *inout, int *len, MPI_Datatype *type) {
+      MPI_Aint lb, extent;
+      MPI_Type_get_extent(*type, &lb, &extent);
+      int count = static_cast<int>(extent/sizeof(Entry));
+      for (int i=0; i<*len; ++i)
+        merge(static_cast<Entry*>(in)+i*count,
+              static_cast<Entry*>(inout)+i*count, count-1, false);
+    }
+#endif
+
+    static RankStats rankStats(const std::string &name, const Entry &e) {
+      RankStats x;
+      x.name = name;
+      x.ranks = e.ranks;
+      x.min = e.min;
+      x.max = e.max;
+      x.mean = e.sum/e.ranks;
+      x.stddev = std::sqrt(std::max(0.0, e.sumsq/e.ranks-x.mean*x.mean));
+      x.imbalance = x.mean > 0.0 ? x.max/x.mean : 1.0;
+      x.fastest = e.fastest;
+      x.slowest = e.slowest;
+      return x;
+    }
+
+    static std::string formatTime(double t) {
+      std::ostringstream os;
+      os << std::setprecision(4) << smartTime(t);
+      return os.str();
+    }
+  };
+
+  class ProfileScope {
+  public:
+    explicit ProfileScope(int id) : active(Profiler::enabled()) {
+      if (active)
+        Profiler::enter(id);
+    }
+    ~ProfileScope() {
+      if (active)
+        Profiler::leave();
+    }
+  private:
+    bool active;
+
+    ProfileScope(const ProfileScope &);
+    ProfileScope &operator=(const ProfileScope &);
+  };
+
+}
+
+#define TIMEUTILS_CONCAT_(a,b) a##b
+#define TIMEUTILS_CONCAT(a,b) TIMEUTILS_CONCAT_(a,b)
+
+#if defined(TIMEUTILS_NO_PROFILER)
+#define TIMEUTILS_SCOPE(name) do {} while (0)
+#else
+#define TIMEUTILS_SCOPE(name) \
+  static const int TIMEUTILS_CONCAT(timeutilsRegion, __LINE__) = \
+    timeutils::Profiler::region(name); \
+  timeutils::ProfileScope TIMEUTILS_CONCAT(timeutilsScope, __LINE__) \
+    (TIMEUTILS_CONCAT(timeutilsRegion, __LINE__))
+#endif
+
+#endif // _TIME_PROFILER_H
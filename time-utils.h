@@ -23,12 +23,22 @@
 #ifndef _TIME_UTILS_H
 #define _TIME_UTILS_H
 
+#include <algorithm>
+#include <cmath>
 #include <ctime>
+#include <string>
 #include <sys/times.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <iostream>
 #include <iomanip>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TIMEUTILS_HAVE_TSC
+#endif
+
 #if defined(HAVE_MPI)
 #include <mpi.h>
 #endif
@@ -42,55 +52,139 @@ namespace timeutils {
 
   class Timer {
   public:
-    Timer() : tic(), toc(), tbeg(), tend()
+
+    // Clock sources. Elapsed times are kept in ns whatever the source.
+    // timesClock     times(), resolution 1/CLK_TCK for user, sys and real
+    // monotonicClock CLOCK_MONOTONIC for real, getrusage() for user and sys
+    // processClock   CLOCK_MONOTONIC for real, CLOCK_PROCESS_CPUTIME_ID for
+    //                user+sys, the sys part from getrusage()
+    // threadClock    as processClock with CLOCK_THREAD_CPUTIME_ID and the
+    //                calling thread's sys time, for timers used by one thread
+    // tscClock       as processClock with real from the time stamp counter,
+    //                calibrated once against CLOCK_MONOTONIC. Assumes an
+    //                invariant TSC, falls back to CLOCK_MONOTONIC elsewhere.
+    // Only real time has ns resolution. With the last three sources user
+    // time is CPU time minus the sys time of getrusage(), so user and sys
+    // are only as fine as the kernel's rusage accounting (often ticks).
+    enum clockType { timesClock, monotonicClock, processClock, threadClock,
+                     tscClock };
+
+    explicit Timer(clockType _clock=defaultClock()) :
+      clock(_clock), tic(), toc()
 #if defined(HAVE_MPI)
       , mpi_tck(MPI_Wtick()), mpi_tbeg(), mpi_tend()
 #endif
     {}
     ~Timer() {}
+
+    // Clock used by default constructed timers, e.g. selected from the
+    // command line with clockFromName()
+    static clockType defaultClock() {
+      return defaultClockRef();
+    }
+    static void setDefaultClock(clockType c) {
+      defaultClockRef() = c;
+    }
+    void setClock(clockType c) {
+      clock = c;
+    }
+    clockType getClock() const {
+      return clock;
+    }
+    static const char *clockName(clockType c) {
+      static const char *names[] = { "times", "monotonic", "process",
+                                     "thread", "tsc" };
+      return names[c];
+    }
+    // Parse a clock name as returned by clockName(), c is left unchanged
+    // and false returned if the name is unknown
+    static bool clockFromName(const std::string &name, clockType &c) {
+      for (int i=timesClock; i<=tscClock; ++i)
+        if (name == clockName(static_cast<clockType>(i))) {
+          c = static_cast<clockType>(i);
+          return true;
+        }
+      return false;
+    }
+    // Resolution in seconds of the real time of the clock
+    double resolution() const {
+      struct timespec ts;
+      switch (clock) {
+      case timesClock:
+        return 1.0/CLK_TCK;
+      case tscClock:
+#if defined(TIMEUTILS_HAVE_TSC)
+        return 1.0e-9*nsPerTick();
+#endif
+      default:
+        clock_getres(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec+1.0e-9*ts.tv_nsec;
+      }
+    }
+
+    // Nominal resolution in seconds of the user time of the clock, the
+    // microsecond of getrusage() for the sources other than times()
+    double userResolution() const {
+      return clock == timesClock ? 1.0/CLK_TCK : 1.0e-6;
+    }
+
     void wallTime(struct tms *buffer, clock_t &rc) const {
       rc = times(buffer);
     }
     void start() {
-      wallTime(&tic, tbeg);
+      sample(tic);
 #if defined(HAVE_MPI)
       mpi_tbeg = MPI_Wtime();
 #endif
     }
     void stop() {
-      wallTime(&toc, tend);
+      sample(toc);
 #if defined(HAVE_MPI)
       mpi_tend = MPI_Wtime();
 #endif
     }
     double userElapsed() const {
-      return static_cast<double>(toc.tms_utime-tic.tms_utime)/CLK_TCK;
+      return 1.0e-9*(toc.user-tic.user);
     }
     double sysElapsed() const {
-      return static_cast<double>(toc.tms_stime-tic.tms_stime)/CLK_TCK;
+      return 1.0e-9*(toc.sys-tic.sys);
     }
     double realElapsed() const {
-      return static_cast<double>(tend-tbeg)/CLK_TCK;
+      return 1.0e-9*(toc.real-tic.real);
     }
 
     double userRunningElapsed() const {
-      struct tms now;
-      clock_t t;
-      wallTime(&now, t);
-      return static_cast<double>(now.tms_utime-tic.tms_utime)/CLK_TCK;
+      Sample now;
+      sample(now);
+      return 1.0e-9*(now.user-tic.user);
     }
     double sysRunningElapsed() const {
-      struct tms now;
-      clock_t t;
-      wallTime(&now, t);
-      return static_cast<double>(now.tms_stime-tic.tms_stime)/CLK_TCK;
+      Sample now;
+      sample(now);
+      return 1.0e-9*(now.sys-tic.sys);
     }
     double realRunningElapsed() const {
-      struct tms now;
-      clock_t t;
-      wallTime(&now, t);
-      return static_cast<double>(t-tbeg)/CLK_TCK;
+      Sample now;
+      sample(now);
+      return 1.0e-9*(now.real-tic.real);
+    }
+#if defined(TIMEUTILS_HAVE_TSC)
+    // ns per time stamp counter tick, measured once over a 10 ms sleep by
+    // the first thread to call it, the others wait for the result. Call it
+    // at start-up to keep the calibration out of the first measurement.
+    static double nsPerTick() {
+      static const double r = [] {
+        struct timespec pause = { 0, 10000000L };
+        long long t0 = clockNs(CLOCK_MONOTONIC);
+        unsigned long long c0 = __rdtsc();
+        nanosleep(&pause, 0);
+        long long t1 = clockNs(CLOCK_MONOTONIC);
+        unsigned long long c1 = __rdtsc();
+        return static_cast<double>(t1-t0)/static_cast<double>(c1-c0);
+      }();
+      return r;
     }
+#endif
 #if defined(HAVE_MPI)
     double mpiElapsed() {
       return mpi_tend - mpi_tbeg;
@@ -100,12 +194,86 @@ namespace timeutils {
     }
 #endif
   private:
-    struct tms tic, toc;
-    clock_t tbeg, tend;
+
+    // user, sys and real times in ns
+    struct Sample {
+      long long user, sys, real;
+      Sample() : user(0), sys(0), real(0) {}
+    };
+
+    clockType clock;
+    Sample tic, toc;
 #if defined(HAVE_MPI)
     double mpi_tck;            // resolution of MPI_Wtime
     double mpi_tbeg, mpi_tend; // seconds
 #endif
+
+    static clockType &defaultClockRef() {
+      static clockType c = processClock;
+      return c;
+    }
+
+    static long long ns(const struct timespec &ts) {
+      return 1000000000LL*ts.tv_sec+ts.tv_nsec;
+    }
+    static long long ns(const struct timeval &tv) {
+      return 1000000000LL*tv.tv_sec+1000LL*tv.tv_usec;
+    }
+    static long long clockNs(clockid_t id) {
+      struct timespec ts;
+      clock_gettime(id, &ts);
+      return ns(ts);
+    }
+
+    void sample(Sample &s) const {
+      struct rusage ru;
+      switch (clock) {
+      case timesClock: {
+        struct tms buf;
+        clock_t rc;
+        wallTime(&buf, rc);
+        s.user = 1000000000LL*buf.tms_utime/CLK_TCK;
+        s.sys = 1000000000LL*buf.tms_stime/CLK_TCK;
+        s.real = 1000000000LL*rc/CLK_TCK;
+        return;
+      }
+      case monotonicClock:
+        getrusage(RUSAGE_SELF, &ru);
+        s.user = ns(ru.ru_utime);
+        s.sys = ns(ru.ru_stime);
+        s.real = clockNs(CLOCK_MONOTONIC);
+        return;
+      case threadClock:
+#if defined(RUSAGE_THREAD)
+        getrusage(RUSAGE_THREAD, &ru);
+#else
+        getrusage(RUSAGE_SELF, &ru);
+#endif
+        s.sys = ns(ru.ru_stime);
+        s.user = clockNs(CLOCK_THREAD_CPUTIME_ID)-s.sys;
+        s.real = clockNs(CLOCK_MONOTONIC);
+        return;
+      case tscClock:
+#if defined(TIMEUTILS_HAVE_TSC)
+      {
+        // calibrate before sampling the other clocks
+        double r = nsPerTick();
+        getrusage(RUSAGE_SELF, &ru);
+        s.sys = ns(ru.ru_stime);
+        s.user = clockNs(CLOCK_PROCESS_CPUTIME_ID)-s.sys;
+        s.real = static_cast<long long>(r*__rdtsc());
+        return;
+      }
+#endif
+      case processClock:
+      default:
+        getrusage(RUSAGE_SELF, &ru);
+        s.sys = ns(ru.ru_stime);
+        s.user = clockNs(CLOCK_PROCESS_CPUTIME_ID)-s.sys;
+        s.real = clockNs(CLOCK_MONOTONIC);
+        return;
+      }
+    }
   };
 
   struct iterStatus {
@@ -154,6 +322,118 @@ namespace timeutils {
     }
   };
 
+  // JSON string of s, with the quotes, backslashes and control characters
+  // escaped
+  struct jsonString {
+    std::string s;
+    explicit jsonString(const std::string &_s) : s(_s) {}
+    friend std::ostream& operator<<(std::ostream &os, const jsonString &x) {
+      static const char hex[] = "0123456789abcdef";
+      os << '"';
+      for (size_t i=0; i<x.s.size(); ++i) {
+        unsigned char c = x.s[i];
+        if (c == '"' || c == '\\')
+          os << '\\' << c;
+        else if (c < 0x20)
+          os << "\\u00" << hex[c >> 4] << hex[c & 0xf];
+        else
+          os << c;
+      }
+      return os << '"';
+    }
+  };
+
+  // Progress of a loop of maxIter iterations with its rate, estimated as
+  // an exponentially weighted moving average of time constant tau, and
+  // time to completion. update() returns true at most once every interval
+  // seconds and at the last iteration, and reads the clock only every few
+  // iterations as predicted by the rate, so that it can be called at every
+  // iteration of fast loops:
+  //
+  //   timeutils::iterProgress progress(maxIter, nx*ny, 60.0);
+  //   for (int i=1; i<=maxIter; ++i) {
+  //     step();
+  //     if (progress.update(i))
+  //       std::cout << progress << std::endl;
+  //   }
+  class iterProgress {
+  public:
+    iterProgress(int _maxIter, double _cellsPerIter=0.0,
+                 double _interval=10.0, double _tau=60.0) :
+      maxIter(_maxIter), cellsPerIter(_cellsPerIter), interval(_interval),
+      tau(_tau), iter(0), lastIter(0), nextCheck(1), stride(1), lastTime(0.0),
+      lastOutput(0.0), now(0.0), itRate(0.0), timer(Timer::monotonicClock) {
+      timer.start();
+    }
+
+    bool update(int _iter) {
+      iter = _iter;
+      if (iter < nextCheck && iter < maxIter)
+        return false;
+      now = timer.realRunningElapsed();
+      double dt = now-lastTime, r = itRate;
+      if (dt > 0.0 && iter > lastIter) {
+        r = (iter-lastIter)/dt;
+        double w = (lastTime == 0.0 ? 1.0 : 1.0-std::exp(-dt/tau));
+        itRate += w*(r-itRate);
+        lastIter = iter;
+        lastTime = now;
+      }
+      // next clock reading in about a tenth of the output interval at the
+      // slower of the average and the last rate, so that a slowdown is
+      // followed at once, and at most half the previous stride when this
+      // reading came later than the interval
+      double next = std::min(itRate, r)*0.1*interval;
+      if (dt > interval)
+        next = std::min(next, 0.5*stride);
+      stride = next < 1.0 ? 1 : next > 1.0e9 ? 1000000000LL :
+               static_cast<long long>(next);
+      nextCheck = iter+stride;
+      if (now-lastOutput >= interval || iter >= maxIter) {
+        lastOutput = now;
+        return true;
+      }
+      return false;
+    }
+
+    // iterations per second
+    double rate() const {
+      return itRate;
+    }
+    // cells per second
+    double throughput() const {
+      return itRate*cellsPerIter;
+    }
+    double elapsed() const {
+      return now;
+    }
+    // estimated time to completion in seconds
+    double eta() const {
+      return itRate > 0.0 ? (maxIter-iter)/itRate : 0.0;
+    }
+
+    friend std::ostream& operator<<(std::ostream &os, const iterProgress &x) {
+      std::streamsize p = os.precision(3);
+      os << iterStatus(x.iter, x.maxIter) << ' ' << x.rate() << " it/s";
+      if (x.cellsPerIter > 0.0)
+        os << ' ' << x.throughput() << " cells/s";
+      os << " elapsed " << toHMS(x.elapsed()) << " ETA " << toHMS(x.eta());
+      os.precision(p);
+      return os;
+    }
+
+  private:
+    int maxIter;
+    double cellsPerIter;
+    double interval;
+    double tau;
+    int iter, lastIter;
+    long long nextCheck, stride;
+    double lastTime, lastOutput, now;
+    double itRate;
+    Timer timer;
+  };
+
 }
 
 #endif // _TIME_UTILS_H